@@ -1,6 +1,7 @@
 import threading
 import queue
 import serial
+import struct
 import time
 import win32gui
 import win32con
@@ -44,12 +45,22 @@ device_names = {}
 key_state = {}
 
 # pairing state machine and device vars
-PAIRING_STAGE = 0
-player1_device = None
-player2_device = None
+NUM_PLAYERS = 2 # keep in sync with MAX_PLAYERS in helloworld.c
+PAIRING_STAGE = 0 # players paired so far
+player_devices = [] # player_devices[i] is player i+1's keyboard
 
 VK_ENTER = 0x0D
 
+# latency tracing: every packet carries a seq (1-255), the FPGA echoes it
+# back with its own stamps (see "Latency tracing" in helloworld.c)
+TRACE_SYNC = 0xA5
+TRACE_RECORD = struct.Struct("<BBBIIII") # sync, player, seq, rx, dispatch, shown, sent
+FPGA_TICKS_PER_MS = 100000 # Usb_timer runs at 100 MHz
+REPORT_EVERY = 10.0 # seconds between latency reports
+
+trace_lock = threading.Lock()
+trace_pending = {} # seq -> (player, t_event, t_write), perf_counter_ns
+
 # =============================================== code below
 
 def get_device_name(hDevice): #defines player 1 vs player 2 HID/VID
@@ -62,7 +73,7 @@ def get_device_name(hDevice): #defines player 1 vs player 2 HID/VID
 # ============================= raw input
 
 def wnd_proc(hwnd, msg, wparam, lparam): #define our own wnd_proc for WM_INPUT messages
-    global PAIRING_STAGE, player1_device, player2_device #mark external
+    global PAIRING_STAGE #mark external
 
     if msg == WM_INPUT:
         size = UINT(0)
@@ -82,24 +93,19 @@ def wnd_proc(hwnd, msg, wparam, lparam): #define our own wnd_proc for WM_INPUT m
                 device_names[hDev] = get_device_name(hDev)
 
             # ================ pairing
-            if pressed and vkey == VK_ENTER:
-
-                if PAIRING_STAGE == 0: #define player 1
-                    player1_device = hDev
-                    PAIRING_STAGE = 1
-                    print(f"[PAIR] Player 1 = {device_names[hDev]}")
-                    return 0
-
-                elif PAIRING_STAGE == 1 and hDev != player1_device: #define player 2
-                    player2_device = hDev
-                    PAIRING_STAGE = 2
-                    print(f"[PAIR] Player 2 = {device_names[hDev]}")
-                    print("[PAIR] Pairing complete. Game starting!")
+            if pressed and vkey == VK_ENTER and PAIRING_STAGE < NUM_PLAYERS:
+
+                if hDev not in player_devices: #next keyboard to press enter is the next player
+                    player_devices.append(hDev)
+                    PAIRING_STAGE = len(player_devices)
+                    print(f"[PAIR] Player {PAIRING_STAGE} = {device_names[hDev]}")
+                    if PAIRING_STAGE == NUM_PLAYERS:
+                        print("[PAIR] Pairing complete. Game starting!")
                     return 0
 
             # after pairing send events to queue for serial to avoid race conditions
-            if PAIRING_STAGE == 2:
-                event_queue.put((hDev, vkey, pressed))
+            if PAIRING_STAGE == NUM_PLAYERS:
+                event_queue.put((hDev, vkey, pressed, time.perf_counter_ns()))
 
     return win32gui.DefWindowProc(hwnd, msg, wparam, lparam)
 
@@ -129,42 +135,140 @@ def rawinput_thread():
 
     windll.user32.RegisterRawInputDevices(byref(rid), 1, sizeof(RAWINPUTDEVICE))
 
-    print("Press ENTER on the P1 keyboard, then ENTER on the P2 keyboard...")
+    print(f"Press ENTER on each keyboard in player order (P1 first, {NUM_PLAYERS} players)...")
     win32gui.PumpMessages() #this part is a blocking run so we need to make this part a seperate thread
 
     
 
 
+# latency histograms
+
+class LatencyHistogram: # 0.1 ms buckets up to 100 ms, anything above goes in the last
+    BUCKET_MS = 0.1
+    BUCKETS = 1000
+
+    def __init__(self):
+        self.counts = [0] * (self.BUCKETS + 1)
+        self.n = 0
+        self.max = 0.0
+
+    def add(self, ms):
+        i = min(max(int(ms / self.BUCKET_MS), 0), self.BUCKETS)
+        self.counts[i] += 1
+        self.n += 1
+        self.max = max(self.max, ms)
+
+    def percentile(self, p): # upper edge of the bucket holding the p-th percentile
+        want = p / 100.0 * self.n
+        seen = 0
+        for i, c in enumerate(self.counts):
+            seen += c
+            if seen >= want:
+                return min((i + 1) * self.BUCKET_MS, self.max)
+        return self.max
+
+# stages, in the order a key goes through them
+STAGES = [
+    ("queue", "host event -> serial write"),
+    ("link", "serial write -> FPGA rx (est. half the round trip outside the FPGA)"),
+    ("dispatch", "FPGA rx -> handler"),
+    ("display", "handler -> board MMIO write"),
+    ("total", "host event -> board MMIO write"),
+]
+
+histograms = {} # (player, stage) -> LatencyHistogram
+
+def record_latency(player, stage, ms):
+    h = histograms.setdefault((player, stage), LatencyHistogram())
+    h.add(ms)
+
+def fpga_ms(a, b): # ticks from a to b, counter wraps at 2^32
+    return ((b - a) & 0xFFFFFFFF) / FPGA_TICKS_PER_MS
+
+def handle_trace(player, seq, rx, dispatch, shown, sent, t_recv):
+    with trace_lock:
+        entry = trace_pending.pop(seq, None)
+    if entry is None or entry[0] != player:
+        return # not ours (title screen, or seq already reused)
+    _, t_event, t_write = entry
+
+    queue_ms = (t_write - t_event) / 1e6
+    round_trip_ms = (t_recv - t_write) / 1e6
+    link_ms = max(round_trip_ms - fpga_ms(rx, sent), 0.0) / 2 # the rest is the wire both ways
+
+    record_latency(player, "queue", queue_ms)
+    record_latency(player, "link", link_ms)
+    record_latency(player, "dispatch", fpga_ms(rx, dispatch))
+    if shown != 0: # 0 = nothing new was drawn for this key
+        display_ms = fpga_ms(dispatch, shown)
+        record_latency(player, "display", display_ms)
+        record_latency(player, "total", queue_ms + link_ms + fpga_ms(rx, shown))
+
+def print_latency_report():
+    for player in range(1, NUM_PLAYERS + 1):
+        rows = [(name, desc, histograms.get((player, name))) for name, desc in STAGES]
+        if not any(h for _, _, h in rows):
+            continue
+        print(f"[Latency] P{player}")
+        for name, desc, h in rows:
+            if h is None:
+                continue
+            print(f"  {name:8s} p50 {h.percentile(50):6.2f} ms  p99 {h.percentile(99):6.2f} ms"
+                  f"  max {h.max:6.2f} ms  n={h.n}  ({desc})")
+
 # serial communication
 
+def serial_reader(ser): # parses the FPGA's trace records
+    buf = bytearray()
+    last_report = time.monotonic()
+
+    while True:
+        data = ser.read(ser.in_waiting or 1)
+        t_recv = time.perf_counter_ns()
+        buf += data
+
+        while len(buf) >= TRACE_RECORD.size:
+            if buf[0] != TRACE_SYNC:
+                del buf[0] # resync
+                continue
+            sync, player, seq, rx, dispatch, shown, sent = TRACE_RECORD.unpack_from(buf)
+            if not (1 <= player <= NUM_PLAYERS) or seq == 0:
+                del buf[0]
+                continue
+            del buf[:TRACE_RECORD.size]
+            handle_trace(player, seq, rx, dispatch, shown, sent, t_recv)
+
+        if time.monotonic() - last_report >= REPORT_EVERY:
+            print_latency_report()
+            last_report = time.monotonic()
+
 def serial_thread(): #this stuff is chill, just connect to FPGA COM port
     ser = serial.Serial("COM3", 115200, timeout=0.1)
     print("[Serial] Connected to FPGA.")
 
     time.sleep(0.01)
+    threading.Thread(target=serial_reader, args=(ser,), daemon=True).start()
 
+    seq = 0
     while True:
-        hDev, vkey, pressed = event_queue.get() #get latest input thread events
+        hDev, vkey, pressed, t_event = event_queue.get() #get latest input thread events
 
         # map to player
-        if hDev == player1_device:
-            player = 1
-        elif hDev == player2_device:
-            player = 2
+        if hDev in player_devices:
+            player = player_devices.index(hDev) + 1
         else:
             continue  # ignore other keyboards
 
         state = 1 if pressed else 0
+        seq = seq % 255 + 1 # 1-255, 0 means untraced
 
-        print(f"[Serial] P{player} key {hex(vkey)} {'DOWN' if state else 'UP'}")
-        
-        packet = bytes([player, vkey, state])
+        packet = bytes([player, vkey, state, seq])
+        t_write = time.perf_counter_ns()
+        with trace_lock:
+            trace_pending[seq] = (player, t_event, t_write)
         ser.write(packet)
 
-        time.sleep(0.002)
-
-        if ser.in_waiting:
-            print("[Serial] FPGA:", ser.read(3)) #print readback(won't actually need this)
+        print(f"[Serial] P{player} key {hex(vkey)} {'DOWN' if state else 'UP'}") # after the write so it isn't timed
 
 # main below
 
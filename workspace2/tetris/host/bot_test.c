@@ -0,0 +1,123 @@
+// CPU opponent checks: a position only a hold can score must get the hold
+// played, in bot-vs-bot games the bots must hold some of the time, and at
+// every gravity level each move must end where the search put it.
+#define main firmware_main
+#include "../src/helloworld.c"
+#undef main
+
+extern uint32_t host_ticks;
+
+#define GAME_FRAMES (60 * 60 * 10)   // ten minutes
+#define LEVEL_FRAMES (60 * 60 * 2)
+
+static Game game;
+static Bot bots[2];
+static uint64_t ran;              // ticks run, as host_ticks wraps every 43 s
+static uint32_t fb[MAX_PLAYERS][BOARD_WORDS], shadow[MAX_PLAYERS][BOARD_WORDS];
+
+static void new_game(uint32_t seed) {
+    memset(&game, 0, sizeof(game));
+    host_ticks = 0;
+    ran = 0;
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        game.players[i] = (Player){
+            .addr = fb[i],
+            .shadow = shadow[i],
+            .x = 3,
+            .hold_piece = EMPTY_HOLD,
+            .can_hold = true
+        };
+    }
+    game.mods.single_player = true;
+    start_game(&game, seed, 0);
+}
+
+// One main loop pass for the bots in use, then on to the next tick the
+// firmware would wake at: a timer or a bot deadline, a frame at most.
+// Returns true once the match is over or until frames have run.
+static bool step(int nbots, uint64_t until) {
+    for (int i = 0; i < nbots; i++) bot_think(&bots[i], host_ticks);
+    bool over = game_step(&game, host_ticks);
+
+    uint32_t wake = host_ticks + FRAME_TICKS, at;
+    if (sched_next(&game.sched, &at) && (int32_t)(at - wake) < 0) wake = at;
+    for (int i = 0; i < nbots; i++) {
+        if (bot_wake(&bots[i], &at) && (int32_t)(at - wake) < 0) wake = at;
+    }
+    if (wake == host_ticks) wake++;
+    ran += wake - host_ticks;
+    host_ticks = wake;
+    return over || ran / FRAME_TICKS >= until;
+}
+
+// runs until the one bot in use has played one move
+static void play_one(void) {
+    uint32_t pieces = bots[0].p->pieces;
+    while (bots[0].p->pieces == pieces && !step(1, GAME_FRAMES)) {}
+}
+
+// four garbage rows with one hole, an I in hold, an S to place and only
+// O pieces coming: the tetris needs the hold
+static bool hold_position(void) {
+    new_game(1);
+    Player *p = &game.players[1];
+    apply_garbage(p, 4);
+    p->piece = 3;                 // S
+    p->hold_piece = PIECE_I;
+    memset(p->next_pieces, PIECE_O, sizeof(p->next_pieces));
+
+    Bot *b = &bots[0];
+    bot_init(b, p, &BOT_DEFAULTS);
+    play_one();
+
+    bool ok = b->holds == 1 && p->linestot == 4;
+    printf("hold position: holds %lu lines %lu %s\n", (unsigned long)b->holds,
+            (unsigned long)p->linestot, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// bot against bot from seed; true if both held at least once and never missed
+static bool bot_game(uint32_t seed) {
+    new_game(seed);
+    for (uint8_t i = 0; i < 2; i++) bot_init(&bots[i], &game.players[i], &BOT_DEFAULTS);
+
+    while (!step(2, GAME_FRAMES)) {}
+
+    bool ok = true;
+    printf("seed %lu: %lu frames", (unsigned long)seed, (unsigned long)(ran / FRAME_TICKS));
+    for (uint8_t i = 0; i < 2; i++) {
+        Player *p = &game.players[i];
+        printf(" | P%u pieces %lu lines %lu holds %lu missed %lu", i + 1, (unsigned long)p->pieces,
+                (unsigned long)p->linestot, (unsigned long)bots[i].holds, (unsigned long)bots[i].misses);
+        ok &= bots[i].holds > 0 && bots[i].misses == 0;
+    }
+    printf(" %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// bot against bot from the gravity of level on; true if no move missed
+static bool level_game(uint32_t level) {
+    new_game(level + 1);
+    game.players[0].linestot = level * 10;
+    update_gravity(&game, level * 10);
+    for (uint8_t i = 0; i < 2; i++) bot_init(&bots[i], &game.players[i], &BOT_DEFAULTS);
+
+    while (!step(2, LEVEL_FRAMES)) {}
+
+    uint32_t pieces = 0, misses = 0;
+    for (uint8_t i = 0; i < 2; i++) {
+        pieces += game.players[i].pieces;
+        misses += bots[i].misses;
+    }
+    printf("level %2lu: %4lu pieces %3lu missed %s\n", (unsigned long)level,
+            (unsigned long)pieces, (unsigned long)misses, misses == 0 ? "ok" : "FAIL");
+    return misses == 0;
+}
+
+int main(void) {
+    bool ok = hold_position();
+    for (uint32_t seed = 1; seed <= 4; seed++) ok &= bot_game(seed);
+    for (uint32_t level = 0; level < NUM_LEVELS; level++) ok &= level_game(level);
+    printf("bot %s\n", ok ? "ok" : "FAIL");
+    return !ok;
+}
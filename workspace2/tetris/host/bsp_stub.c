@@ -0,0 +1,52 @@
+// Host stand-ins for the BSP drivers helloworld.c calls. Nothing here
+// touches hardware: the timer counters all read host_ticks, which the
+// tests move by hand, a test can watch counters being started through
+// host_timer_started, and the rest do nothing.
+#include "xparameters.h"
+#include "xuartlite.h"
+#include "xgpio.h"
+#include "xintc.h"
+#include "xil_exception.h"
+#include "xtmrctr.h"
+#include "mb_interface.h"
+#include "platform.h"
+
+uint32_t host_ticks;
+uint32_t host_timer_reset[2];              // last reset value per counter
+void (*host_timer_started)(u8 counter);    // called by XTmrCtr_Start if set
+
+void init_platform(void) {}
+void cleanup_platform(void) {}
+void mb_sleep(void) {}
+
+int XTmrCtr_Initialize(XTmrCtr *tmr, u16 device_id) { return 0; }
+void XTmrCtr_SetOptions(XTmrCtr *tmr, u8 counter, u32 options) {}
+void XTmrCtr_SetResetValue(XTmrCtr *tmr, u8 counter, u32 value) { host_timer_reset[counter & 1] = value; }
+void XTmrCtr_SetHandler(XTmrCtr *tmr, XTmrCtr_Handler handler, void *ref) {}
+void XTmrCtr_Start(XTmrCtr *tmr, u8 counter) { if (host_timer_started) host_timer_started(counter); }
+void XTmrCtr_Stop(XTmrCtr *tmr, u8 counter) {}
+u32 XTmrCtr_GetValue(XTmrCtr *tmr, u8 counter) { return host_ticks; }
+void XTmrCtr_InterruptHandler(void *tmr) {}
+
+int XGpio_Initialize(XGpio *gpio, u16 device_id) { return 0; }
+void XGpio_SetDataDirection(XGpio *gpio, unsigned channel, u32 mask) {}
+void XGpio_DiscreteWrite(XGpio *gpio, unsigned channel, u32 data) {}
+u32 XGpio_DiscreteRead(XGpio *gpio, unsigned channel) { return 0; }
+void XGpio_InterruptEnable(XGpio *gpio, u32 mask) {}
+void XGpio_InterruptGlobalEnable(XGpio *gpio) {}
+void XGpio_InterruptClear(XGpio *gpio, u32 mask) {}
+
+int XIntc_Initialize(XIntc *intc, u16 device_id) { return 0; }
+int XIntc_Connect(XIntc *intc, u8 id, XInterruptHandler handler, void *ref) { return 0; }
+int XIntc_Start(XIntc *intc, u8 mode) { return 0; }
+void XIntc_Enable(XIntc *intc, u8 id) {}
+void XIntc_InterruptHandler(void *intc) {}
+
+int XUartLite_Initialize(XUartLite *uart, u16 device_id) { return 0; }
+void XUartLite_EnableInterrupt(XUartLite *uart) {}
+u32 XUartLite_ReadReg(uintptr_t base, u32 offset) { return 0; }
+void XUartLite_WriteReg(uintptr_t base, u32 offset, u32 value) {}
+
+void Xil_ExceptionInit(void) {}
+void Xil_ExceptionRegisterHandler(u32 id, Xil_ExceptionHandler handler, void *data) {}
+void Xil_ExceptionEnable(void) {}
@@ -0,0 +1,66 @@
+// idle_until against a simulated wake alarm and UART (HOST_IRQ_STANDIN):
+// it must never sleep through an alarm that fired while it was being armed,
+// must sleep exactly to a deadline otherwise, and never longer than
+// IDLE_MAX_TICKS.
+#define main firmware_main
+#include "../src/helloworld.c"
+#undef main
+
+extern uint32_t host_ticks;
+extern uint32_t host_timer_reset[2];
+extern void (*host_timer_started)(u8 counter);
+
+#define ARM_COST 300   // ticks arming the alarm takes on the board, roughly
+
+static int slept;
+static uint32_t last_alarm;
+
+// an alarm shorter than the arming itself has gone off before idle_until
+// gets to look
+static void alarm_started(u8 counter) {
+    if (counter == WAKE_COUNTER && host_timer_reset[counter] < ARM_COST) {
+        wake_timer_isr(&Usb_timer, counter);
+    }
+}
+
+void host_sleep(uint32_t alarm) {
+    slept++;
+    last_alarm = alarm;
+    host_ticks += alarm;
+    wake_timer_isr(&Usb_timer, WAKE_COUNTER);
+}
+
+int main(void) {
+    int bad = 0;
+    host_timer_started = alarm_started;
+
+    for (uint32_t w = 1; w < 2000; w++) {
+        slept = 0;
+        host_ticks = 5000;
+        idle_until(true, host_ticks + w);
+        bool ok = (w < ARM_COST) ? !slept : (slept == 1 && last_alarm == w);
+        if (!ok) {
+            printf("wait %lu: slept %d alarm %lu\n", (unsigned long)w, slept, (unsigned long)last_alarm);
+            bad++;
+        }
+    }
+
+    slept = 0;
+    idle_until(false, 0);
+    printf("no deadline: slept %d for %lu ticks\n", slept, (unsigned long)last_alarm);
+    if (slept != 1 || last_alarm != IDLE_MAX_TICKS) bad++;
+
+    slept = 0;
+    idle_until(true, host_ticks + 10 * FRAME_TICKS);
+    printf("deadline 10 frames out: slept %d for %lu ticks\n", slept, (unsigned long)last_alarm);
+    if (slept != 1 || last_alarm != IDLE_MAX_TICKS) bad++;
+
+    slept = 0;
+    host_rx_byte(1, host_ticks);
+    idle_until(true, host_ticks + 100000);
+    printf("byte waiting: slept %d\n", slept);
+    if (slept) bad++;
+
+    printf("idle %s\n", bad ? "FAIL" : "ok");
+    return bad != 0;
+}
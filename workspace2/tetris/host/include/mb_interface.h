@@ -0,0 +1,4 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+
+void mb_sleep(void);
@@ -0,0 +1,5 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+
+void init_platform(void);
+void cleanup_platform(void);
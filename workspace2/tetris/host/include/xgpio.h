@@ -0,0 +1,17 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+#include "xil_types.h"
+
+typedef struct {
+    int unused;
+} XGpio;
+
+#define XGPIO_IR_CH1_MASK 1
+
+int XGpio_Initialize(XGpio *gpio, u16 device_id);
+void XGpio_SetDataDirection(XGpio *gpio, unsigned channel, u32 mask);
+void XGpio_DiscreteWrite(XGpio *gpio, unsigned channel, u32 data);
+u32 XGpio_DiscreteRead(XGpio *gpio, unsigned channel);
+void XGpio_InterruptEnable(XGpio *gpio, u32 mask);
+void XGpio_InterruptGlobalEnable(XGpio *gpio);
+void XGpio_InterruptClear(XGpio *gpio, u32 mask);
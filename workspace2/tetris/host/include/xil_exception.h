@@ -0,0 +1,10 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+#include "xil_types.h"
+
+typedef void (*Xil_ExceptionHandler)(void *data);
+#define XIL_EXCEPTION_ID_INT 0
+
+void Xil_ExceptionInit(void);
+void Xil_ExceptionRegisterHandler(u32 id, Xil_ExceptionHandler handler, void *data);
+void Xil_ExceptionEnable(void);
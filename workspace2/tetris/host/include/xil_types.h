@@ -0,0 +1,7 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
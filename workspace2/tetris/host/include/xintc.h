@@ -0,0 +1,16 @@
+// Host stand-in for the BSP header: only what helloworld.c uses.
+#pragma once
+#include "xil_types.h"
+
+typedef struct {
+    int unused;
+} XIntc;
+
+typedef void (*XInterruptHandler)(void *ref);
+#define XIN_REAL_MODE 1
+
+int XIntc_Initialize(XIntc *intc, u16 device_id);
+int XIntc_Connect(XIntc *intc, u8 id, XInterruptHandler handler, void *ref);
+int XIntc_Start(XIntc *intc, u8 mode);
+void XIntc_Enable(XIntc *intc, u8 id);
+void XIntc_InterruptHandler(void *intc);
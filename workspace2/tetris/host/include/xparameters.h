@@ -0,0 +1,11 @@
+// Host stand-in for the BSP header: the device and interrupt ids from
+// mb_usb.bd that helloworld.c uses. No vsync GPIO, like the current design.
+#pragma once
+
+#define XPAR_UARTLITE_0_DEVICE_ID 0
+#define XPAR_PLAYER1KEYCODE_DEVICE_ID 0
+#define XPAR_PLAYER2KEYCODE_DEVICE_ID 1
+#define XPAR_TIMER_USB_AXI_DEVICE_ID 0
+#define XPAR_MICROBLAZE_0_AXI_INTC_DEVICE_ID 0
+#define XPAR_MICROBLAZE_0_AXI_INTC_AXI_UARTLITE_0_INTERRUPT_INTR 0
+#define XPAR_MICROBLAZE_0_AXI_INTC_TIMER_USB_AXI_INTERRUPT_INTR 1
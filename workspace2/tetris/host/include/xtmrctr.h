@@ -0,0 +1,22 @@
+// Host stand-in for the BSP header: only what helloworld.c uses. Counter
+// values come from host_ticks, see bsp_stub.c.
+#pragma once
+#include "xil_types.h"
+
+typedef struct {
+    int unused;
+} XTmrCtr;
+
+typedef void (*XTmrCtr_Handler)(void *ref, u8 counter);
+#define XTC_INT_MODE_OPTION 0x01
+#define XTC_AUTO_RELOAD_OPTION 0x10
+#define XTC_DOWN_COUNT_OPTION 0x20
+
+int XTmrCtr_Initialize(XTmrCtr *tmr, u16 device_id);
+void XTmrCtr_SetOptions(XTmrCtr *tmr, u8 counter, u32 options);
+void XTmrCtr_SetResetValue(XTmrCtr *tmr, u8 counter, u32 value);
+void XTmrCtr_SetHandler(XTmrCtr *tmr, XTmrCtr_Handler handler, void *ref);
+void XTmrCtr_Start(XTmrCtr *tmr, u8 counter);
+void XTmrCtr_Stop(XTmrCtr *tmr, u8 counter);
+u32 XTmrCtr_GetValue(XTmrCtr *tmr, u8 counter);
+void XTmrCtr_InterruptHandler(void *tmr);
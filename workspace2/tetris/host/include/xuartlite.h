@@ -0,0 +1,22 @@
+// Host stand-in for the BSP header: only what helloworld.c uses. Register
+// reads see an empty RX FIFO and writes go nowhere.
+#pragma once
+#include <stdint.h>
+#include "xil_types.h"
+
+typedef struct {
+    uintptr_t RegBaseAddress;
+} XUartLite;
+
+#define XUL_RX_FIFO_OFFSET 0
+#define XUL_TX_FIFO_OFFSET 4
+#define XUL_STATUS_REG_OFFSET 8
+#define XUL_SR_RX_FIFO_VALID_DATA 0x01
+#define XUL_SR_TX_FIFO_FULL 0x08
+#define XUL_SR_OVERRUN_ERROR 0x20
+#define XUL_SR_FRAMING_ERROR 0x40
+
+int XUartLite_Initialize(XUartLite *uart, u16 device_id);
+void XUartLite_EnableInterrupt(XUartLite *uart);
+u32 XUartLite_ReadReg(uintptr_t base, u32 offset);
+void XUartLite_WriteReg(uintptr_t base, u32 offset, u32 value);
@@ -0,0 +1,8 @@
+// Two-peer rollback check, see rollback_selftest in helloworld.c.
+#define main firmware_main
+#include "../src/helloworld.c"
+#undef main
+
+int main(void) {
+    return rollback_selftest() ? 0 : 1;
+}
@@ -19,15 +19,54 @@
 #include "xparameters.h"
 #include "xuartlite.h"
 #include "xgpio.h"
+#include "xintc.h"
+#include "xil_exception.h"
+#include "mb_interface.h"
 #include <xtmrctr.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
 
 #define UART_DEVICE_ID XPAR_UARTLITE_0_DEVICE_ID
+#define INTC_DEVICE_ID XPAR_MICROBLAZE_0_AXI_INTC_DEVICE_ID
+#define UART_INTR_ID XPAR_MICROBLAZE_0_AXI_INTC_AXI_UARTLITE_0_INTERRUPT_INTR
+#define TIMER_INTR_ID XPAR_MICROBLAZE_0_AXI_INTC_TIMER_USB_AXI_INTERRUPT_INTR
+// GPIO input wired to vga_controller's vs; without it frames are timed
+// off Usb_timer instead
+#ifdef XPAR_VSYNC_DEVICE_ID
+#define VSYNC_GPIO_ID XPAR_VSYNC_DEVICE_ID
+#endif
+// vsync GPIO's ip2intc_irpt on the intc; lets the idle loop sleep through
+// the frame instead of polling vs. In0-In3 of the interrupt concat are
+// already uart, timer, gpio_usb_int and spi_usb, so this needs a fifth (In4)
+#ifdef XPAR_MICROBLAZE_0_AXI_INTC_VSYNC_IP2INTC_IRPT_INTR
+#define VSYNC_INTR_ID XPAR_MICROBLAZE_0_AXI_INTC_VSYNC_IP2INTC_IRPT_INTR
+#endif
 #define PLAYER_1_CODE_GPIO_ID XPAR_PLAYER1KEYCODE_DEVICE_ID
 #define PLAYER_2_CODE_GPIO_ID XPAR_PLAYER2KEYCODE_DEVICE_ID
 
-#define BOARD_P1 ((volatile uint32_t*)0x44A10000)
-#define BOARD_P2 ((volatile uint32_t*)0x44A10064)
+// Players in a match, one board register window each, back to back from
+// BOARD_BASE (board i at BOARD_BASE + i * BOARD_WORDS words). Has to match
+// the number of boards in the hardware design; 2 to 8.
+#ifndef MAX_PLAYERS
+#define MAX_PLAYERS 2
+#endif
+#if MAX_PLAYERS < 2 || MAX_PLAYERS > 8
+#error "MAX_PLAYERS must be 2..8"
+#endif
+
+// Code main does not call, left out of the firmware so it fits in BRAM:
+// ROLLBACK builds the snapshots and rollback netplay driver, MOVEGEN the
+// move generator. The benches and self-tests that use them turn them on.
+#if defined(ROLLBACK_SELFTEST) && !defined(ROLLBACK)
+#define ROLLBACK
+#endif
+#if defined(PERFT_BENCH) && !defined(MOVEGEN)
+#define MOVEGEN
+#endif
+
+#define BOARD_BASE ((volatile uint32_t*)0x44A10000)
+#define BOARD_ADDR(i) (BOARD_BASE + (i) * BOARD_WORDS)
 
 #include <stdint.h>
 
@@ -55,7 +94,6 @@
 #define KEY_SINGLE_PLAYER_MOD 0x54
 
 
-#define MAX_PIECES 1000
 #define EMPTY_HOLD 255
 
 
@@ -63,6 +101,35 @@
 #define BOARD_HEIGHT 20
 
 #define LOCK_DELAY_TICKS 50000000
+#define FRAME_TICKS 1666667 // 100 MHz / 60 Hz
+#define TICKS_PER_MS 100000
+// gravity in G (rows per frame), 16.16 fixed point
+#define G_SHIFT 16
+#define G_ONE (1u << G_SHIFT)
+#define G_MAX (20 * G_ONE) // 20G: lands the piece the frame it spawns
+// Usb_timer counter 0 free-runs as the game clock; counter 1 is a one-shot
+// alarm that wakes the CPU from sleep at the next deadline
+#define CLOCK_COUNTER 0
+#define WAKE_COUNTER 1
+
+// Occupancy rows: bit (x + ROW_WALL_BITS) is set when cell x of the row is filled.
+// The 3 bits on each side are permanent walls, so a piece row shifted off
+// the edge of the board collides without any bounds branches.
+#define ROW_WALL_BITS 3
+#define ROW_EMPTY 0xE007
+#define ROW_FULL  0xFFFF
+#define ROW_BIT(x) ((uint16_t)(1u << ((x) + ROW_WALL_BITS)))
+
+// board register window: 200 4-bit cells, row-major, 8 per word, first
+// cell in the top nibble
+#define BOARD_WORDS 25
+#define COLOR_GHOST 9
+
+// landing table: one entry per piece x from -ROW_WALL_BITS to BOARD_WIDTH - 1
+#define DROP_COLS (BOARD_WIDTH + ROW_WALL_BITS)
+
+// attacks a player can have waiting before they merge, see queue_garbage
+#define GARBAGE_QUEUE_LEN 8
 
 
 
@@ -74,343 +141,364 @@ typedef struct {
     bool single_player;
 } GameMods;
 
-GameMods mods = {
-    .no_hold = false,
-    .fast_grav = false,
-    .messy_garbage = false,
-    .no_garbage = false,
-    .single_player = false,
-};
 
 
-// TETROMINOES[piece][rot][row][col]
-uint8_t TETROMINOES[7][4][4][4] = {
-    // I piece
-    {
-        {   // rot 0
-            {4,4,4,4},
-            {0,0,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {   // rot 1
-            {0,0,4,0},
-            {0,0,4,0},
-            {0,0,4,0},
-            {0,0,4,0}
-        },
-        {   // rot 2
-            {4,4,4,4},
-            {0,0,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {   // rot 3
-            {0,4,0,0},
-            {0,4,0,0},
-            {0,4,0,0},
-            {0,4,0,0}
-        }
-    },
+// PIECE_MASK[piece][rot]: the piece's 4x4 box, bit 4*row + col set where it
+// has a block. Colors come from PIECE_COLOR.
+const uint16_t PIECE_MASK[7][4] = {
+    {0x000F, 0x4444, 0x000F, 0x2222}, // I
+    {0x0033, 0x0033, 0x0033, 0x0033}, // O
+    {0x0072, 0x0262, 0x0270, 0x0232}, // T
+    {0x0036, 0x0231, 0x0036, 0x0231}, // S
+    {0x0063, 0x0264, 0x0063, 0x0264}, // Z
+    {0x0071, 0x0226, 0x0470, 0x0322}, // J
+    {0x0074, 0x0622, 0x0170, 0x0223}, // L
+};
 
-    // O piece
-    {
-        {
-            {6,6,0,0},
-            {6,6,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {   // same for all rotations
-            {6,6,0,0},
-            {6,6,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {6,6,0,0},
-            {6,6,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {6,6,0,0},
-            {6,6,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        }
-    },
+#define PIECE_I 0
+#define PIECE_O 1
 
-    // T piece
-    {
-        {   // rot 0
-            {0,5,0,0},
-            {5,5,5,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {   // rot 1
-            {0,5,0,0},
-            {0,5,5,0},
-            {0,5,0,0},
-            {0,0,0,0}
-        },
-        {   // rot 2
-            {0,0,0,0},
-            {5,5,5,0},
-            {0,5,0,0},
-            {0,0,0,0}
-        },
-        {   // rot 3
-            {0,5,0,0},
-            {5,5,0,0},
-            {0,5,0,0},
-            {0,0,0,0}
-        }
-    },
+// Wall kicks, SRS_KICKS[piece == PIECE_I][from rot][ccw][test]: offsets
+// tried in order when turning from rot, y down. These are the SRS tables as
+// published, which are relative to the SRS boxes; piece_kicks moves them
+// onto ours with SRS_BOX. O never kicks.
+#define KICK_TESTS 5
 
-    // S piece
-    {
-        {
-            {0,1,1,0},
-            {1,1,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {1,0,0,0},
-            {1,1,0,0},
-            {0,1,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,1,1,0},
-            {1,1,0,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {1,0,0,0},
-            {1,1,0,0},
-            {0,1,0,0},
-            {0,0,0,0}
-        }
-    },
+typedef struct {
+    int8_t x, y;
+} Kick;
+
+// SRS_BOX[piece][rot]: where our box puts the piece against the SRS box for
+// that state. Flat I sits on row 0 (SRS: row 1, row 2 upside down) and S and
+// Z reuse states 0 and 1 for 2 and 3, which SRS has a row or column over.
+// A turn from a to b kicks by the SRS test + SRS_BOX[a] - SRS_BOX[b], so
+// I, S and Z don't always try (0, 0) first: a flat I on the top row can't
+// stand up in place, SRS would put it above the board.
+const Kick SRS_BOX[7][4] = {
+    {{0, -1}, {0, 0}, {0, -2}, {0, 0}},  // I
+    {{0, 0}, {0, 0}, {0, 0}, {0, 0}},    // O
+    {{0, 0}, {0, 0}, {0, 0}, {0, 0}},    // T
+    {{0, 0}, {-1, 0}, {0, -1}, {0, 0}},  // S
+    {{0, 0}, {0, 0}, {0, -1}, {1, 0}},   // Z
+    {{0, 0}, {0, 0}, {0, 0}, {0, 0}},    // J
+    {{0, 0}, {0, 0}, {0, 0}, {0, 0}},    // L
+};
 
-    // Z piece
-    {
-        {
-            {7,7,0,0},
-            {0,7,7,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,0,7,0},
-            {0,7,7,0},
-            {0,7,0,0},
-            {0,0,0,0}
-        },
-        {
-            {7,7,0,0},
-            {0,7,7,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,0,7,0},
-            {0,7,7,0},
-            {0,7,0,0},
-            {0,0,0,0}
-        }
+const Kick SRS_KICKS[2][4][2][KICK_TESTS] = {
+    { // J L S T Z
+        {{{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}},    // 0 -> R
+         {{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}}},      // 0 -> L
+        {{{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}},      // R -> 2
+         {{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}}},     // R -> 0
+        {{{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}},       // 2 -> L
+         {{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}}},   // 2 -> R
+        {{{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}},   // L -> 0
+         {{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}},  // L -> 2
     },
-
-    // J piece
-    {
-        {
-            {2,0,0,0},
-            {2,2,2,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,2,2,0},
-            {0,2,0,0},
-            {0,2,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,0,0,0},
-            {2,2,2,0},
-            {0,0,2,0},
-            {0,0,0,0}
-        },
-        {
-            {0,2,0,0},
-            {0,2,0,0},
-            {2,2,0,0},
-            {0,0,0,0}
-        }
+    { // I
+        {{{0, 0}, {-2, 0}, {1, 0}, {-2, 1}, {1, -2}},     // 0 -> R
+         {{0, 0}, {-1, 0}, {2, 0}, {-1, -2}, {2, 1}}},    // 0 -> L
+        {{{0, 0}, {-1, 0}, {2, 0}, {-1, -2}, {2, 1}},     // R -> 2
+         {{0, 0}, {2, 0}, {-1, 0}, {2, -1}, {-1, 2}}},    // R -> 0
+        {{{0, 0}, {2, 0}, {-1, 0}, {2, -1}, {-1, 2}},     // 2 -> L
+         {{0, 0}, {1, 0}, {-2, 0}, {1, 2}, {-2, -1}}},    // 2 -> R
+        {{{0, 0}, {1, 0}, {-2, 0}, {1, 2}, {-2, -1}},     // L -> 0
+         {{0, 0}, {-2, 0}, {1, 0}, {-2, 1}, {1, -2}}},    // L -> 2
     },
+};
 
-    // L piece
-    {
-        {
-            {0,0,3,0},
-            {3,3,3,0},
-            {0,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {0,3,0,0},
-            {0,3,0,0},
-            {0,3,3,0},
-            {0,0,0,0}
-        },
-        {
-            {0,0,0,0},
-            {3,3,3,0},
-            {3,0,0,0},
-            {0,0,0,0}
-        },
-        {
-            {3,3,0,0},
-            {0,3,0,0},
-            {0,3,0,0},
-            {0,0,0,0}
-        }
+// writes the kick tests for turning piece from rot by dir (1 = cw,
+// 3 = ccw), moved onto our boxes
+static inline void piece_kicks(uint8_t piece, uint8_t rot, uint8_t dir, Kick kick[KICK_TESTS]) {
+    const Kick *srs = SRS_KICKS[piece == PIECE_I][rot][dir == 3];
+    const Kick from = SRS_BOX[piece][rot], to = SRS_BOX[piece][(rot + dir) & 3];
+    for (int i = 0; i < KICK_TESTS; i++) {
+        kick[i].x = srs[i].x + from.x - to.x;
+        kick[i].y = srs[i].y + from.y - to.y;
     }
+}
+
+// color of each piece, same order as PIECE_MASK
+const uint8_t PIECE_COLOR[7] = {COLOR_I, COLOR_O, COLOR_T, COLOR_S, COLOR_Z, COLOR_J, COLOR_L};
+
+// row j of a PIECE_MASK entry, bit i = column i
+static inline uint8_t piece_row(uint16_t mask, int j) {
+    return (mask >> (4 * j)) & 0xF;
+}
+
+// 4x5 glyphs, one byte per row, bit 3 = leftmost column
+const uint8_t E4[5] = {
+    0xF, // ####
+    0x8, // #...
+    0xE, // ###.
+    0x8, // #...
+    0xF  // ####
 };
 
-const char E4[5][5] = {
-    "####",
-    "#   ",
-    "### ",
-    "#   ",
-    "####"
+const uint8_t C4[5] = {
+    0x7, // .###
+    0x8, // #...
+    0x8, // #...
+    0x8, // #...
+    0x7  // .###
 };
 
-const char C4[5][5] = {
-    " ###",
-    "#   ",
-    "#   ",
-    "#   ",
-    " ###"
+const uint8_t NUM3[5] = {
+    0xE, // ###.
+    0x2, // ..#.
+    0xE, // ###.
+    0x2, // ..#.
+    0xE  // ###.
 };
 
-const char NUM3[5][5] = {
-    "### ",
-    "  # ",
-    "### ",
-    "  # ",
-    "### "
+const uint8_t NUM8[5] = {
+    0x6, // .##.
+    0x9, // #..#
+    0x6, // .##.
+    0x9, // #..#
+    0x6  // .##.
 };
 
-const char NUM8[5][5] = {
-    " ## ",
-    "#  #",
-    " ## ",
-    "#  #",
-    " ## "
+const uint8_t NUM5[5] = {
+    0xF, // ####
+    0x8, // #...
+    0xE, // ###.
+    0x1, // ...#
+    0xF  // ####
 };
 
-const char NUM5[5][5] = {
-    "####",
-    "#   ",
-    "### ",
-    "   #",
-    "####"
+const uint8_t Q4[5] = {
+    0x6, // .##.
+    0x9, // #..#
+    0x9, // #..#
+    0xB, // #.##
+    0x7  // .###
 };
 
-const char Q4[5][5] = {
-    " ## ",
-    "#  #",
-    "#  #",
-    "# ##",
-    " ###"
+const uint8_t W4[5] = {
+    0x9, // #..#
+    0x9, // #..#
+    0x9, // #..#
+    0xB, // #.##
+    0x6  // .##.
 };
 
-const char W4[5][5] = {
-    "#  #",
-    "#  #",
-    "#  #",
-    "# ##",
-    " ## #"
+const uint8_t R4[5] = {
+    0xE, // ###.
+    0x9, // #..#
+    0xE, // ###.
+    0xA, // #.#.
+    0x9  // #..#
 };
 
-const char R4[5][5] = {
-    "### ",
-    "#  #",
-    "### ",
-    "# # ",
-    "#  #"
+const uint8_t T4[5] = {
+    0xF, // ####
+    0x6, // .##.
+    0x6, // .##.
+    0x6, // .##.
+    0x6  // .##.
 };
 
-const char T4[5][5] = {
-    "####",
-    " ## ",
-    " ## ",
-    " ## ",
-    " ## "
+const uint8_t CHECK4[5] = {
+    0x1, // ...#
+    0x2, // ..#.
+    0xA, // #.#.
+    0x6, // .##.
+    0x4  // .#..
 };
 
-const char CHECK4[5][5] = {
-    "   #",
-    "  # ",
-    "# # ",
-    " ## ",
-    " #  "
+
+const uint8_t X4[5] = {
+    0x9, // #..#
+    0x6, // .##.
+    0x6, // .##.
+    0x6, // .##.
+    0x9  // #..#
 };
 
 
-const char X4[5][5] = {
-    "#  #",
-    " ## ",
-    " ## ",
-    " ## ",
-    "#  #"
+
+
+
+
+
+// actions a key can be bound to
+enum {
+    ACTION_NONE = 0,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_SOFTDROP,
+    ACTION_HARDDROP,
+    ACTION_ROTATE_CW,
+    ACTION_ROTATE_CCW,
+    ACTION_HOLD,
+    NUM_ACTIONS
 };
 
+// Auto-repeat handling, shared by both players. Holding left/right shifts
+// once, waits das_ticks, then shifts every arr_ticks (0 = straight to the
+// wall). Holding soft drop steps down at sdf times the gravity speed
+// (SDF_INSTANT = straight to the floor).
+#define SDF_INSTANT 0
 
+typedef struct {
+    uint32_t das_ticks;
+    uint32_t arr_ticks;
+    uint8_t sdf;
+} RepeatConfig;
+
+// copied into each Game by start_game
+const RepeatConfig REPEAT_DEFAULTS = {
+    .das_ticks = 167 * TICKS_PER_MS,
+    .arr_ticks = 33 * TICKS_PER_MS,
+    .sdf = 20,
+};
 
+// KEY_BINDINGS[virtual key code] = action fired when that key goes down
+const uint8_t KEY_BINDINGS[256] = {
+    [KEY_LEFT]       = ACTION_LEFT,
+    [KEY_RIGHT]      = ACTION_RIGHT,
+    [KEY_SOFTDROP]   = ACTION_SOFTDROP,
+    [KEY_HARDDROP]   = ACTION_HARDDROP,
+    [KEY_ROTATE_CW]  = ACTION_ROTATE_CW,
+    [KEY_ROTATE_CCW] = ACTION_ROTATE_CCW,
+    [KEY_HOLD]       = ACTION_HOLD,
+};
 
+// ACTION_KEYS[action] = a key bound to it, for turning actions back into key
+// events (rollback input replay)
+const uint8_t ACTION_KEYS[NUM_ACTIONS] = {
+    [ACTION_LEFT]       = KEY_LEFT,
+    [ACTION_RIGHT]      = KEY_RIGHT,
+    [ACTION_SOFTDROP]   = KEY_SOFTDROP,
+    [ACTION_HARDDROP]   = KEY_HARDDROP,
+    [ACTION_ROTATE_CW]  = KEY_ROTATE_CW,
+    [ACTION_ROTATE_CCW] = KEY_ROTATE_CCW,
+    [ACTION_HOLD]       = KEY_HOLD,
+};
 
 
 
-uint8_t p1_left_prev = 0;
-uint8_t p1_right_prev = 0;
-uint8_t p1_down_prev = 0;
 
+// xoshiro128** state, see rng_next
+typedef struct {
+    uint32_t s[4];
+} Rng;
 
-uint8_t p2_left_prev = 0;
-uint8_t p2_right_prev = 0;
-uint8_t p2_down_prev = 0;
+#define INPUT_QUEUE_SIZE 16 // power of two
 
+// one key packet, stamped with the Usb_timer tick its last byte arrived at
+typedef struct {
+	u8 key;
+	u8 state;
+	u8 seq;              // host's tag for latency tracing, 0 = not traced
+	uint32_t tick;
+} InputEvent;
 
+// a traced key event on its way to the screen, see trace_dispatch
+typedef struct {
+	u8 seq;
+	uint32_t rx;         // tick its packet was received at
+	uint32_t dispatch;   // tick its handler ran at
+} LatencyTrace;
 
+#define TRACE_PENDING 4      // traced events per player waiting on a frame
 
-typedef struct{
-	uint8_t grid[10][20];
-	volatile uint32_t* addr;
-	uint8_t piece; // 0, 1, 2, ... same order as tetrominoes
+// bounded FIFO of a player's key events, consumed in order by dispatch_input
+typedef struct {
+	InputEvent ev[INPUT_QUEUE_SIZE];
+	uint8_t head;
+	uint8_t tail;
+	uint32_t dropped;    // events lost because the queue was full
+} InputQueue;
+
+typedef struct Player {
+	// ---- match state: everything up to image is what a Snapshot saves,
+	// so anything that changes how the game plays out belongs above it ----
+
+	// board rows form a ring: logical row y (0 = top) lives in slot
+	// board_row(p, y), so shifting the whole stack is just moving base
+	uint8_t cells[20][10]; // colors, [slot][x]
+	uint16_t rows[20];     // occupancy bitmask per slot, kept in sync with cells
+	uint8_t base;          // slot holding logical row 0
+	uint8_t piece; // 0, 1, 2, ... same order as PIECE_MASK
 	int16_t x; // signed now
 	int16_t y; // signed now
 	uint8_t rot; // 0 ,1 ,2,3 clockwise rotations
-	uint8_t lines;
 	uint32_t linestot;
-	uint16_t next_piece_index;
 	uint32_t score;
-	volatile uint32_t* holdaddr;
+	uint32_t pieces;       // pieces dealt so far, counted by spawn_new_piece
 
 	 uint8_t hold_piece;         // 0-6, 255 for empty
 	 bool can_hold;              // true if player can hold
 	 uint8_t next_pieces[5];
 
+	 // randomizer: pieces come out of a 7-bag shuffled from piece_rng,
+	 // garbage holes and TARGET_RANDOM picks from their own streams so none
+	 // of them disturbs another
+	 Rng piece_rng;
+	 Rng garbage_rng;
+	 Rng target_rng;
+	 uint8_t bag[7];
+	 uint8_t bag_left;           // pieces not yet taken from bag
+
 	 bool lock_delay_active;
 	 uint32_t lock_delay_start;
+
+	 uint32_t lock_rows;         // rows written by the last lock_piece, bit per row
+
+	 uint32_t keys_down[8];      // pressed-key bitmap, bit per virtual key code
+
+	 // auto-repeat state, see auto_repeat
+	 uint8_t held;               // bit per ACTION_* whose key is down
+	 int8_t shift_dir;           // -1 left, 1 right, 0 not shifting
+	 bool shift_charged;         // DAS has elapsed, now repeating at ARR
+	 uint32_t shift_last;        // tick of the last shift (or the key-down)
+	 uint32_t soft_last;         // tick of the last soft drop step
+	 uint32_t soft_interval;     // ticks per soft drop step, 0 = instant
+
+	 uint32_t gravity_acc;       // fraction of a row built up, G_ONE = 1 row
+	 uint32_t gravity_frames;    // frames covered by the pending gravity timer
+
+	 // attacks received but not applied yet, oldest first; they go in at
+	 // this player's next lock, each with its own hole column
+	 uint8_t garbage_queue[GARBAGE_QUEUE_LEN];
+	 uint8_t garbage_head;
+	 uint8_t garbage_count;
+
+	 bool alive;                 // still in the match, not topped out
+
+	// ---- derived from the above, or wiring; rebuilt after a restore ----
+
+	// the same colors packed exactly like the board register window, so a
+	// frame push is a word copy; excludes the falling piece and ghost
+	uint32_t image[BOARD_WORDS];
+
+	 uint64_t hash;              // Zobrist key of the occupied cells, see board_hash
+
+	 // landing table for the current piece: bit y of drop_fit[rot][x] is set
+	 // when the piece collides at row y. Entries are filled on demand and
+	 // thrown away whenever the board or the piece changes.
+	 uint32_t drop_fit[4][DROP_COLS];
+	 uint16_t drop_valid[4];     // bit per x, set once drop_fit entry is filled
+	 uint8_t drop_piece;         // piece the table was built for
+
+	 bool dirty;                 // state changed since the last render
+
+	 LatencyTrace trace[TRACE_PENDING]; // dispatched, not drawn yet
+	 uint8_t trace_count;
+
+	 InputQueue input;
+
+	volatile uint32_t* addr;
+	uint32_t* shadow;      // last values written to addr, see mmio_update
+
+	 struct Game *game;          // match this player is in
+	 uint8_t index;              // slot in game->players, also its timer ids
 } Player;
 
-uint8_t piece_queue[MAX_PIECES];
+// bytes of a Player a Snapshot keeps, see the layout above
+#define PLAYER_STATE_SIZE offsetof(Player, image)
 
 // Initialize once at game start
 
@@ -418,24 +506,123 @@ XUartLite Uart;
 XGpio P1KeycodeGpio;
 XGpio P2KeycodeGpio;
 XTmrCtr Usb_timer;
+XIntc Intc;
+#ifdef VSYNC_GPIO_ID
+XGpio VsyncGpio;
+#endif
+
+// hold piece then the 5 next pieces, a nibble each, for every player in
+// turn, packed from the top nibble of word 0; see pack_holdnext
+#define HOLDNEXT ((volatile uint32_t*) 0x44A00000)
+#define HOLDNEXT_NIBBLES 6
+#define HOLDNEXT_WORDS ((MAX_PLAYERS * HOLDNEXT_NIBBLES + 7) / 8)
+
+// Shadow copies of the write-only register windows. Every write goes through
+// mmio_update, which only puts words on the bus when their value changed.
+uint32_t board_shadow[MAX_PLAYERS][BOARD_WORDS];
+uint32_t holdnext_shadow[HOLDNEXT_WORDS];
+
+uint32_t mmio_writes_issued = 0;
+uint32_t mmio_writes_suppressed = 0;
+
+void mmio_update(volatile uint32_t *addr, uint32_t *shadow, const uint32_t *src, int n) {
+    for (int k = 0; k < n; k++) {
+        if (shadow[k] == src[k]) {
+            mmio_writes_suppressed++;
+            continue;
+        }
+        shadow[k] = src[k];
+        *(addr + k) = src[k];
+        mmio_writes_issued++;
+    }
+}
+
+// clears a window so the hardware matches its (zeroed) shadow
+void mmio_reset(volatile uint32_t *addr, uint32_t *shadow, int n) {
+    for (int k = 0; k < n; k++) {
+        *(addr + k) = 0;
+        shadow[k] = 0;
+    }
+}
+
+
+// slot in cells/rows holding logical board row y (0 <= y < BOARD_HEIGHT)
+static inline int board_row(const Player *p, int y) {
+    int r = y + p->base;
+    return (r >= BOARD_HEIGHT) ? r - BOARD_HEIGHT : r;
+}
+
+// sets cell (x, y) of a packed board image
+static inline void image_set(uint32_t *image, int x, int y, uint8_t color) {
+    int n = y * BOARD_WIDTH + x;
+    int shift = 28 - ((n & 7) << 2);
+    image[n >> 3] = (image[n >> 3] & ~(0xFu << shift)) | ((uint32_t)color << shift);
+}
+
+static inline uint8_t image_get(const uint32_t *image, int x, int y) {
+    int n = y * BOARD_WIDTH + x;
+    return (image[n >> 3] >> (28 - ((n & 7) << 2))) & 0xF;
+}
+
+// rebuilds image from cells after rows have moved (clear_lines, apply_garbage)
+void pack_image(Player *p) {
+    uint32_t temp = 0;
+    int word = 0;
+    int n = 0;
+
+    for (int j = 0; j < BOARD_HEIGHT; j++) {
+        const uint8_t *row = p->cells[board_row(p, j)];
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            temp = (temp << 4) | (row[i] & 0xF);
+            if (++n == 8) {
+                p->image[word++] = temp;
+                n = 0;
+            }
+        }
+    }
+}
 
+// call after anything that changes cells/rows
+void invalidate_drops(Player *p) {
+    for (int r = 0; r < 4; r++) {
+        p->drop_valid[r] = 0;
+    }
+}
 
-void draw_letter_4x5(Player *p, int x0, int y0, const char pattern[5][5], uint8_t color) {
+void draw_letter_4x5(Player *p, int x0, int y0, const uint8_t glyph[5], uint8_t color) {
     for (int y = 0; y < 5; y++) {
+        uint8_t bits = glyph[y];
+        if (bits == 0) continue;
         for (int x = 0; x < 4; x++) {
-            if (pattern[y][x] == '#') {
+            if (bits & (8 >> x)) {
                 int gx = x0 + x;
                 int gy = y0 + y;
-                if (gx >= 0 && gx < 10 && gy >= 0 && gy < 20)
-                    p->grid[gx][gy] = color;
+                if (gx >= 0 && gx < 10 && gy >= 0 && gy < 20) {
+                    int r = board_row(p, gy);
+                    p->cells[r][gx] = color;
+                    p->rows[r] |= ROW_BIT(gx);
+                    image_set(p->image, gx, gy, color);
+                }
             }
         }
     }
+    invalidate_drops(p);
 }
 
 
+void clear_board(Player *p) { //clears board struct
+    memset(p->cells, 0, sizeof(p->cells));
+    memset(p->image, 0, sizeof(p->image));
+    for (int y = 0; y < BOARD_HEIGHT; y++) {
+        p->rows[y] = ROW_EMPTY;
+    }
+    p->base = 0;
+    p->hash = 0;
+    invalidate_drops(p);
+}
+
 void draw_ECE385(Player *p) {
-    memset(p->grid, 0, sizeof(p->grid));
+    clear_board(p);
     uint8_t C = COLOR_I;
 
     // Top row: E and 3
@@ -451,495 +638,2564 @@ void draw_ECE385(Player *p) {
     draw_letter_4x5(p, 5, 14, NUM5, C);
 }
 
-void clear_board(Player *p) { //clears board struct
-    for (int x = 0; x < BOARD_WIDTH; x++) {
-        for (int y = 0; y < BOARD_HEIGHT; y++) {
-            p->grid[x][y] = 0;
-        }
-    }
-}
-
-void draw_mod_list(Player *p1, Player *p2){ //draws mods on screen
+void draw_mod_list(const GameMods *m, Player *p1, Player *p2){ //draws mods on screen
 	clear_board(p1);
 	clear_board(p2);
 	draw_letter_4x5(p1, 0, 2, Q4, COLOR_L);
-	draw_letter_4x5(p1, 5, 2, mods.no_hold ? CHECK4 : X4, mods.no_hold ? COLOR_S : COLOR_Z);
+	draw_letter_4x5(p1, 5, 2, m->no_hold ? CHECK4 : X4, m->no_hold ? COLOR_S : COLOR_Z);
 
 	draw_letter_4x5(p1, 0, 8, W4, COLOR_L);
-	draw_letter_4x5(p1, 5, 8, mods.fast_grav ? CHECK4 : X4, mods.fast_grav ? COLOR_S : COLOR_Z);
+	draw_letter_4x5(p1, 5, 8, m->fast_grav ? CHECK4 : X4, m->fast_grav ? COLOR_S : COLOR_Z);
 
 	draw_letter_4x5(p1, 0, 14, E4, COLOR_L);
-	draw_letter_4x5(p1, 5, 14, mods.messy_garbage ? CHECK4 : X4, mods.messy_garbage ? COLOR_S : COLOR_Z);
+	draw_letter_4x5(p1, 5, 14, m->messy_garbage ? CHECK4 : X4, m->messy_garbage ? COLOR_S : COLOR_Z);
 
 	draw_letter_4x5(p2, 0, 2, R4, COLOR_L);
-	draw_letter_4x5(p2, 5, 2, mods.no_garbage ? CHECK4 : X4, mods.no_garbage ? COLOR_S : COLOR_Z);
+	draw_letter_4x5(p2, 5, 2, m->no_garbage ? CHECK4 : X4, m->no_garbage ? COLOR_S : COLOR_Z);
 
 	draw_letter_4x5(p2, 0, 8, T4, COLOR_L);
-	draw_letter_4x5(p2, 5, 8, mods.single_player ? CHECK4 : X4, mods.single_player ? COLOR_S : COLOR_Z);
+	draw_letter_4x5(p2, 5, 8, m->single_player ? CHECK4 : X4, m->single_player ? COLOR_S : COLOR_Z);
 }
 
 
+#ifndef VSYNC_GPIO_ID
+uint32_t last_frame = 0;
+#endif
+
 // -------------------------------------------
-// Non-blocking UART read attempt
-// returns 1 if a byte was read, 0 otherwise
+// Returns true once per displayed frame: on the falling edge of vs (active
+// low, so the start of vertical blanking), or every FRAME_TICKS if the
+// vsync GPIO is not in the hardware design. Poll it every loop pass.
 // -------------------------------------------
-int try_recv_byte(u8 *dst) {
-    return XUartLite_Recv(&Uart, dst, 1);
+bool frame_ready(uint32_t now) {
+#ifdef VSYNC_GPIO_ID
+    static u32 last_vs = 1;
+    u32 vs = XGpio_DiscreteRead(&VsyncGpio, 1) & 1;
+    bool edge = (last_vs == 1 && vs == 0);
+    last_vs = vs;
+    return edge;
+#else
+    if ((uint32_t)(now - last_frame) < FRAME_TICKS) return false;
+    last_frame = now;
+    return true;
+#endif
+}
+
+// When frame_ready can next return true, for the idle loop. False if an
+// interrupt (vsync) will wake us for it anyway.
+bool next_frame(uint32_t now, uint32_t *deadline) {
+    (void)now; // only the polled vs build needs it
+#if defined(VSYNC_GPIO_ID) && defined(VSYNC_INTR_ID)
+    return false;
+#elif defined(VSYNC_GPIO_ID)
+    *deadline = now; // no interrupt on vs, so keep polling it
+    return true;
+#else
+    *deadline = last_frame + FRAME_TICKS;
+    return true;
+#endif
 }
 
 // -------------------------------------------
-// Process one input packet (player, key, state)
+// Title screen: turns on the mod for a key-down on its key.
+// Returns true if the mod list changed and needs to be redrawn.
 // -------------------------------------------
-void process_input_event(u8 player, u8 key, u8 state) {
-    static u8 last_key = 0;
-    static u8 last_state = 0;
-    static int have_last = 0;
-
-    // ignore duplicate repeat events (this lowk doesnt really work)
-    if (have_last && key == last_key && state == last_state)
-        return;
-
-    last_key = key;
-    last_state = state;
-    have_last = 1;
-
-    if (player == 1) {
-        XGpio_DiscreteWrite(&P1KeycodeGpio, 1, key);
-    } else if (player == 2) {
-        XGpio_DiscreteWrite(&P2KeycodeGpio, 1, key);
+bool apply_mod_key(GameMods *m, u8 key, u8 state) {
+    bool *mod;
+
+    if (state != 1) return false;
+    switch (key) {
+        case KEY_NO_HOLD_MOD:       mod = &m->no_hold; break;
+        case KEY_FAST_GRAV_MOD:     mod = &m->fast_grav; break;
+        case KEY_MESSY_GARBAGE_MOD: mod = &m->messy_garbage; break;
+        case KEY_NO_GARBAGE_MOD:    mod = &m->no_garbage; break;
+        case KEY_SINGLE_PLAYER_MOD: mod = &m->single_player; break;
+        default: return false;
     }
+    if (*mod) return false;
+    *mod = true;
+    return true;
 }
 
+// -------------------------------------------
+// Deadline scheduler: a binary min-heap of armed timers ordered by
+// Usb_timer deadline. Every per-player timer (gravity, lock delay,
+// auto-repeat) lives here; the main loop pops whatever is due and runs it
+// as of its deadline, and sched_next says when the next one is.
+// Deadlines are compared as signed differences so the 32-bit counter can
+// wrap, as long as no timer is armed more than ~21 s ahead.
+// -------------------------------------------
+enum {
+    TIMER_GRAVITY = 0,
+    TIMER_LOCK,
+    TIMER_REPEAT,
+    TIMER_KINDS
+};
 
-// returns true if collision, false if no collision
-bool check_collision(Player *p, int x, int y) {
-    uint8_t (*shape)[4] = TETROMINOES[p->piece][p->rot];
+#define MAX_TIMERS (TIMER_KINDS * MAX_PLAYERS)
+#define TIMER_ID(player, kind) ((kind) * MAX_PLAYERS + (player))
+#define TIMER_PLAYER(id) ((id) % MAX_PLAYERS)
+#define TIMER_KIND(id) ((id) / MAX_PLAYERS)
 
-    for(int i = 0; i < 4; i++) {       // column in tetromino
-        for(int j = 0; j < 4; j++) {   // row in tetromino
-            if(shape[j][i] == 0) continue; // empty cell, skip
+typedef struct {
+    uint32_t deadline[MAX_TIMERS];
+    uint8_t heap[MAX_TIMERS];    // timer ids, earliest deadline at heap[0]
+    int8_t pos[MAX_TIMERS];      // index of each id in heap, -1 if not armed
+    uint8_t count;
+} Scheduler;
+
+// Where a player's attacks go, see route_attack. With two players every
+// target mode picks the other one.
+enum {
+    TARGET_NEXT = 0,   // next live player after us, in slot order
+    TARGET_RANDOM,     // any live opponent
+    TARGET_LEADER,     // live opponent with the highest score
+};
 
-            int board_x = x + i;
-            int board_y = y + j;
+typedef struct {
+    uint8_t target;    // TARGET_*
+    bool split;        // share the attack out over every live opponent instead
+    bool counter;      // attack cancels our own incoming garbage first
+} AttackPolicy;
+
+// copied into each Game by start_game
+const AttackPolicy ATTACK_DEFAULTS = {
+    .target = TARGET_NEXT,
+    .split = false,
+    .counter = false,
+};
+
+// -------------------------------------------
+// One match: mods, handling, timers, gravity and the players. The rules
+// only reach state through a Player and its game, so several matches can
+// run side by side (host simulation, a bot looking ahead).
+// -------------------------------------------
+typedef struct Game {
+    GameMods mods;
+    RepeatConfig repeat;
+    AttackPolicy attack;
+    Scheduler sched;
+    uint32_t gravity;         // G, see gravity_table
+    uint32_t gravity_ticks;   // ticks per row at gravity, for soft drop timing
+    uint32_t seen_lines;      // line total the level was last worked out from
+    uint8_t num_players;
+    Player players[MAX_PLAYERS];
+} Game;
+
+static inline bool sched_before(const Scheduler *s, uint8_t a, uint8_t b) {
+    return (int32_t)(s->deadline[a] - s->deadline[b]) < 0;
+}
 
-            // Check boundaries
-            if(board_x < 0 || board_x >= BOARD_WIDTH) return true;
-            if(board_y < 0 || board_y >= BOARD_HEIGHT) return true;
+static void sched_swap(Scheduler *s, int i, int j) {
+    uint8_t a = s->heap[i];
+    uint8_t b = s->heap[j];
+    s->heap[i] = b;
+    s->heap[j] = a;
+    s->pos[b] = i;
+    s->pos[a] = j;
+}
 
-            // Check collision with existing blocks
-            if(p->grid[board_x][board_y] != 0) return true;
-        }
+// restores heap order around index i after its deadline changed
+static void sched_fix(Scheduler *s, int i) {
+    while (i > 0 && sched_before(s, s->heap[i], s->heap[(i - 1) / 2])) {
+        sched_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int m = i;
+        if (l < s->count && sched_before(s, s->heap[l], s->heap[m])) m = l;
+        if (r < s->count && sched_before(s, s->heap[r], s->heap[m])) m = r;
+        if (m == i) return;
+        sched_swap(s, i, m);
+        i = m;
     }
+}
 
-    return false; // no collision
+void sched_init(Scheduler *s) {
+    s->count = 0;
+    for (int id = 0; id < MAX_TIMERS; id++) {
+        s->pos[id] = -1;
+    }
 }
-//dont worry about drawing pieces
-void writeboard_raw(Player* p) {
-    uint32_t temp = 0;
-    int idx = 0;
 
-    for (int j = 0; j < 20; j++) {
-        for (int i = 0; i < 10; i++) {
-            uint8_t cell = p->grid[i][j];
+// arms timer id for deadline, moving it if it is already armed
+void sched_set(Scheduler *s, uint8_t id, uint32_t deadline) {
+    s->deadline[id] = deadline;
+    if (s->pos[id] < 0) {
+        s->heap[s->count] = id;
+        s->pos[id] = s->count;
+        s->count++;
+    }
+    sched_fix(s, s->pos[id]);
+}
 
-            // pack into 32-bit temp
-            if (idx % 8 == 0)
-                temp = 0;
+void sched_cancel(Scheduler *s, uint8_t id) {
+    int i = s->pos[id];
+    if (i < 0) return;
 
-            temp |= (cell & 0xF) << (4 * (7 - (idx % 8)));
+    s->count--;
+    s->pos[id] = -1;
+    if (i != s->count) {
+        s->heap[i] = s->heap[s->count];
+        s->pos[s->heap[i]] = i;
+        sched_fix(s, i);
+    }
+}
 
-            if (idx % 8 == 7) {
-                *(p->addr + (idx / 8)) = temp;
-            }
+bool sched_armed(const Scheduler *s, uint8_t id) {
+    return s->pos[id] >= 0;
+}
 
-            idx++;
-        }
-    }
+// earliest armed deadline; false if nothing is armed
+bool sched_next(const Scheduler *s, uint32_t *deadline) {
+    if (s->count == 0) return false;
+    *deadline = s->deadline[s->heap[0]];
+    return true;
 }
 
+// disarms and returns the earliest timer if it is due by now
+bool sched_pop_due(Scheduler *s, uint32_t now, uint8_t *id, uint32_t *deadline) {
+    if (s->count == 0) return false;
+    uint8_t first = s->heap[0];
+    if ((int32_t)(now - s->deadline[first]) < 0) return false;
 
-void writeboard(Player* p) {
-    uint32_t temp;
-    uint8_t idx;
-    uint8_t piece_cell;
+    *id = first;
+    *deadline = s->deadline[first];
+    sched_cancel(s, first);
+    return true;
+}
 
-    // Calculate drop position (ghost piece)
-    int drop_y = p->y;
-    while (!check_collision(p, p->x, drop_y + 1)) {
-        drop_y++;
+// -------------------------------------------
+// UART receive ring, filled by uart_rx_isr and drained by the main loop.
+// Single producer (ISR) / single consumer (main): the ISR only writes
+// rx_head, the main loop only writes rx_tail.
+// -------------------------------------------
+#define RX_RING_SIZE 64 // power of two
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+u8 rx_ring[RX_RING_SIZE];
+uint32_t rx_stamp[RX_RING_SIZE]; // Usb_timer tick each byte was received at
+volatile uint8_t rx_head = 0;
+volatile uint8_t rx_tail = 0;
+
+// error counters, readable from the debugger
+volatile uint32_t uart_overruns = 0;     // UART Lite FIFO overran before we read it
+volatile uint32_t uart_framing_errors = 0;
+volatile uint32_t uart_ring_drops = 0;   // bytes lost because rx_ring was full
+uint32_t uart_bad_packets = 0;           // bytes skipped to resynchronize packets
+
+volatile uint32_t irq_count = 0;         // bumped by every ISR, see idle_until
+
+void uart_rx_isr(void *ref) {
+    XUartLite *uart = (XUartLite *)ref;
+    u32 status;
+
+    // empty the whole FIFO; reading the status register clears the error bits
+    while ((status = XUartLite_ReadReg(uart->RegBaseAddress, XUL_STATUS_REG_OFFSET))
+            & XUL_SR_RX_FIFO_VALID_DATA) {
+        if (status & XUL_SR_OVERRUN_ERROR) uart_overruns++;
+        if (status & XUL_SR_FRAMING_ERROR) uart_framing_errors++;
+
+        u8 b = XUartLite_ReadReg(uart->RegBaseAddress, XUL_RX_FIFO_OFFSET);
+        uint8_t next = (rx_head + 1) & RX_RING_MASK;
+        if (next == rx_tail) {
+            uart_ring_drops++;
+            continue;
+        }
+        rx_ring[rx_head] = b;
+        rx_stamp[rx_head] = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+        rx_head = next;
     }
+    irq_count++;
+}
 
-    for(int j = 0; j < 20; j++) {
-        for(int i = 0; i < 10; i++) {
-            idx = i + j * 10;
-
-            if(idx % 8 == 0) temp = 0;
+// Nothing else to do: taking the interrupt is what ends mb_sleep in idle_until.
+void wake_timer_isr(void *ref, u8 counter) {
+    (void)ref;
+    (void)counter;
+    irq_count++;
+}
 
-            // Base grid cell
-            uint8_t cell = p->grid[i][j];
+#ifdef VSYNC_INTR_ID
+void vsync_isr(void *ref) {
+    XGpio_InterruptClear((XGpio *)ref, XGPIO_IR_CH1_MASK);
+    irq_count++;
+}
+#endif
+
+void init_interrupts() {
+    XIntc_Initialize(&Intc, INTC_DEVICE_ID);
+    XIntc_Connect(&Intc, UART_INTR_ID, (XInterruptHandler)uart_rx_isr, &Uart);
+    XIntc_Connect(&Intc, TIMER_INTR_ID, (XInterruptHandler)XTmrCtr_InterruptHandler, &Usb_timer);
+#ifdef VSYNC_INTR_ID
+    XIntc_Connect(&Intc, VSYNC_INTR_ID, (XInterruptHandler)vsync_isr, &VsyncGpio);
+#endif
+    XIntc_Start(&Intc, XIN_REAL_MODE);
+    XIntc_Enable(&Intc, UART_INTR_ID);
+    XIntc_Enable(&Intc, TIMER_INTR_ID);
+#ifdef VSYNC_INTR_ID
+    XIntc_Enable(&Intc, VSYNC_INTR_ID);
+#endif
+
+    // counts down from the reset value and stops at zero with an interrupt
+    XTmrCtr_SetHandler(&Usb_timer, wake_timer_isr, &Usb_timer);
+    XTmrCtr_SetOptions(&Usb_timer, WAKE_COUNTER, XTC_INT_MODE_OPTION | XTC_DOWN_COUNT_OPTION);
+
+    Xil_ExceptionInit();
+    Xil_ExceptionRegisterHandler(XIL_EXCEPTION_ID_INT,
+            (Xil_ExceptionHandler)XIntc_InterruptHandler, &Intc);
+    Xil_ExceptionEnable();
+
+    XUartLite_EnableInterrupt(&Uart);
+}
 
-            // Ghost piece overlay (only if actual piece not present)
-            int rel_x = i - p->x;
-            int rel_y = j - drop_y;
-            if(rel_x >= 0 && rel_x < 4 && rel_y >= 0 && rel_y < 4) {
-                uint8_t ghost_cell = TETROMINOES[p->piece][p->rot][rel_y][rel_x];
-                if(ghost_cell != 0 && cell == 0) {
-                    cell = 9;  // ghost color
-                }
-            }
+// -------------------------------------------
+// Idle
+// Instead of spinning on the UART ring, the main loops sleep the CPU until
+// something can have changed: a received byte, the wake alarm at the next
+// scheduler/frame deadline, or vsync. Everything that talks to the sleep
+// hardware is in here; a host build defines HOST_IRQ_STANDIN and supplies
+// host_sleep instead (../host/idle_test.c).
+// -------------------------------------------
+#define IDLE_MAX_TICKS FRAME_TICKS  // longest sleep, see idle_until
 
-            // Actual piece overlay (draw on top)
-            rel_x = i - p->x;
-            rel_y = j - p->y;
-            if(rel_x >= 0 && rel_x < 4 && rel_y >= 0 && rel_y < 4) {
-                piece_cell = TETROMINOES[p->piece][p->rot][rel_y][rel_x];
-                if(piece_cell != 0) {
-                    cell = piece_cell;  // overwrite ghost/grid
-                }
-            }
+volatile uint32_t idle_sleeps = 0;  // times we actually went to sleep
 
-            // Shift into temp
-            temp += cell << (4 * (7 - (idx % 8)));
+#ifdef HOST_IRQ_STANDIN
+// Stands in for mb_sleep and the interrupts that end it: returns once the
+// harness has delivered a byte (host_rx_byte) or alarm ticks have passed
+// (calling wake_timer_isr), whichever is first.
+void host_sleep(uint32_t alarm);
 
-            if(idx % 8 == 7) {
-                *(p->addr + idx / 8) = temp;
-            }
-        }
+// what uart_rx_isr does for one received byte, stamped at tick stamp
+void host_rx_byte(u8 b, uint32_t stamp) {
+    uint8_t next = (rx_head + 1) & RX_RING_MASK;
+    if (next == rx_tail) {
+        uart_ring_drops++;
+    } else {
+        rx_ring[rx_head] = b;
+        rx_stamp[rx_head] = stamp;
+        rx_head = next;
     }
+    irq_count++;
+}
+#define idle_sleep(alarm) host_sleep(alarm)
+#else
+#define idle_sleep(alarm) mb_sleep()
+#endif
+
+void arm_wake_timer(uint32_t ticks) {
+    XTmrCtr_Stop(&Usb_timer, WAKE_COUNTER);
+    XTmrCtr_SetResetValue(&Usb_timer, WAKE_COUNTER, ticks);
+    XTmrCtr_Start(&Usb_timer, WAKE_COUNTER);
 }
 
+// Sleeps until an interrupt, the deadline, or IDLE_MAX_TICKS from now,
+// whichever comes first. Returns right away if the deadline already passed
+// or input is waiting.
+// Checking and sleeping can't be one atomic step here: MicroBlaze only
+// wakes from a sleep with interrupts masked through its Wakeup inputs,
+// which mb_usb.bd leaves unconnected. An interrupt taken after irq_count is
+// sampled (the alarm firing while it is armed, a byte) skips the sleep,
+// which leaves only the few instructions before mb_sleep open. The alarm
+// is always armed, so an interrupt lost in there costs at most
+// IDLE_MAX_TICKS of lateness, never a stall.
+void idle_until(bool has_deadline, uint32_t deadline) {
+    uint32_t seen = irq_count;
+    uint32_t wait = IDLE_MAX_TICKS;
+
+    if (has_deadline) {
+        int32_t left = (int32_t)(deadline - XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER));
+        if (left <= 0) return;
+        if ((uint32_t)left < wait) wait = (uint32_t)left;
+    }
+    arm_wake_timer(wait);
 
-void lock_piece(Player* p, int x) {
-    uint8_t (*shape)[4] = TETROMINOES[p->piece][p->rot]; // current piece, no rotation
-
-    for(int i = 0; i < 4; i++) {       // column in tetromino
-        for(int j = 0; j < 4; j++) {   // row in tetromino
-            if(shape[j][i] == 0) continue;
-
-            int board_x = x + i;
-            int board_y = p->y + j;
+    if (rx_head != rx_tail || irq_count != seen) return;
+    idle_sleeps++;
+    idle_sleep(wait);
+}
 
-            // Make sure we are inside board
-            if(board_x >= 0 && board_x < 10 && board_y >= 0 && board_y < 20) {
-                p->grid[board_x][board_y] = shape[j][i];
-            }
-        }
-    }
+// -------------------------------------------
+// Non-blocking UART read attempt
+// returns 1 if a byte was read, 0 otherwise
+// -------------------------------------------
+int try_recv_byte(u8 *dst, uint32_t *stamp) {
+    if (rx_tail == rx_head) return 0;
+    *dst = rx_ring[rx_tail];
+    *stamp = rx_stamp[rx_tail];
+    rx_tail = (rx_tail + 1) & RX_RING_MASK;
+    return 1;
 }
 
+// -------------------------------------------
+// Packet assembly: (player, key, state, seq) with player 1..MAX_PLAYERS,
+// state 0 or 1 and seq the host's latency trace tag (0 = untraced).
+// A byte that cannot start a valid packet is dropped, so a lost or corrupt
+// byte costs one packet instead of misframing everything after it.
+// -------------------------------------------
+#define PACKET_LEN 4
 
+typedef struct {
+    u8 buf[PACKET_LEN];
+    uint8_t len;
+} PacketParser;
 
-static uint32_t rng_state = 1; // seed
+PacketParser rx_parser;
 
-uint8_t simple_rand(int k) {
-    rng_state = rng_state * 1664525 + 1013904223; // LCG
-    return (rng_state >> 16) % k; // return 0..6
+static void parser_skip(PacketParser *pp) {
+    memmove(pp->buf, pp->buf + 1, PACKET_LEN - 1);
+    pp->len--;
+    uart_bad_packets++;
 }
 
-void init_piece_queue() {
-    for (int i = 0; i < MAX_PIECES; i++) {
-        piece_queue[i] = simple_rand(7);  // 0..6 for tetromino types
+// returns true and fills packet when b completes a packet
+bool packet_feed(PacketParser *pp, u8 b, u8 packet[PACKET_LEN]) {
+    pp->buf[pp->len++] = b;
+    while (pp->len > 0) {
+        if (pp->buf[0] < 1 || pp->buf[0] > MAX_PLAYERS) {
+            parser_skip(pp);
+            continue;
+        }
+        if (pp->len < 3) return false;
+        if (pp->buf[2] > 1) {
+            parser_skip(pp);
+            continue;
+        }
+        if (pp->len < PACKET_LEN) return false;
+        memcpy(packet, pp->buf, PACKET_LEN);
+        pp->len = 0;
+        return true;
     }
+    return false;
 }
-//returns true if game over
-bool spawn_new_piece(Player* p) {
-	p->piece = p->next_pieces[0];  // take from shared queue
-    p->y = 0;                       // top of board
-    p->x = (BOARD_WIDTH / 2) - 2;   // center horizontally
-    p->rot = 0;
-    p->can_hold = true;           // reset hold ability for new piece
-
-	// shift next_pieces left and fill last from queue
-	for (int i = 0; i < 4; i++) {
-		p->next_pieces[i] = p->next_pieces[i + 1];
-	}
-	p->next_pieces[4] = piece_queue[p->next_piece_index];
-	p->next_piece_index = (p->next_piece_index + 1) % MAX_PIECES;
 
-    if (check_collision(p, p->x, p->y)) {
-        // handle game over
-    	return true;
+// drains the RX ring until one whole packet is assembled; stamp gets the
+// tick the packet's last byte arrived at
+bool recv_packet(u8 packet[PACKET_LEN], uint32_t *stamp) {
+    u8 b;
+    while (try_recv_byte(&b, stamp)) {
+        if (packet_feed(&rx_parser, b, packet)) return true;
     }
     return false;
 }
 
-
-// Returns true if piece was locked (hit the bottom or another piece)
-bool apply_gravity(Player* p, int x, uint32_t current_tick) {
-    if(!check_collision(p, x, p->y + 1)) {
-        // Can move down - cancel any active lock delay
-        p->y++;
-        p->lock_delay_active = false;
+// -------------------------------------------
+// Per-player input queue
+// -------------------------------------------
+bool input_push(InputQueue *q, u8 key, u8 state, u8 seq, uint32_t tick) {
+    uint8_t next = (q->head + 1) & (INPUT_QUEUE_SIZE - 1);
+    if (next == q->tail) {
+        q->dropped++;
         return false;
-    } else {
-        // Collision detected - start or continue lock delay
-        if (!p->lock_delay_active) {
-            // Start the lock delay timer
-            p->lock_delay_active = true;
-            p->lock_delay_start = current_tick;
-            return false;  // Don't lock yet
-        } else {
-            // Check if lock delay has expired
-            if ((uint32_t)(current_tick - p->lock_delay_start) >= LOCK_DELAY_TICKS) {
-                // Lock delay expired - lock the piece
-                lock_piece(p, x);
-                p->lock_delay_active = false;
-                bool gameover = spawn_new_piece(p);
-                return gameover;
-            }
-            return false;  // Still in lock delay
-        }
     }
+    q->ev[q->head].key = key;
+    q->ev[q->head].state = state;
+    q->ev[q->head].seq = seq;
+    q->ev[q->head].tick = tick;
+    q->head = next;
+    return true;
 }
 
-void handle_left_right(Player *p, int key, int state, uint8_t *prev_left, uint8_t *prev_right)
-{
-    if (state == 1) {
-        // LEFT
-        if (key == KEY_LEFT) {
-            if (*prev_left == 0) {
-                if (!check_collision(p, p->x - 1, p->y)) {
-                    p->x--;
-                    // Reset lock delay if piece can now move down
-                    if (!check_collision(p, p->x, p->y + 1)) {
-                        p->lock_delay_active = false;
-                    }
-                }
-            }
-            *prev_left = 1;
-            *prev_right = 0;
-            return;
-        }
+bool input_pop(InputQueue *q, InputEvent *ev) {
+    if (q->tail == q->head) return false;
+    *ev = q->ev[q->tail];
+    q->tail = (q->tail + 1) & (INPUT_QUEUE_SIZE - 1);
+    return true;
+}
 
-        // RIGHT
-        if (key == KEY_RIGHT) {
-            if (*prev_right == 0) {
-                if (!check_collision(p, p->x + 1, p->y)) {
-                    p->x++;
-                    // Reset lock delay if piece can now move down
-                    if (!check_collision(p, p->x, p->y + 1)) {
-                        p->lock_delay_active = false;
-                    }
-                }
-            }
-            *prev_right = 1;
-            *prev_left = 0;
-            return;
-        }
-    }
+// records key as pressed/released in the bitmap; returns false if it was
+// already in that state (a host key repeat)
+bool key_update(uint32_t down[8], u8 key, u8 state) {
+    uint32_t bit = 1u << (key & 31);
+    uint32_t *word = &down[key >> 5];
+    bool was_down = (*word & bit) != 0;
 
-    *prev_left = 0;
-    *prev_right = 0;
+    if (was_down == (state != 0)) return false;
+    *word ^= bit;
+    return true;
 }
 
+// -------------------------------------------
+// Latency tracing
+// The host tags each key packet with a seq. The FPGA stamps it when its
+// last byte arrives (rx_stamp), when dispatch_input runs it, and when the
+// player's board is next written out. Then it sends the stamps back as one
+// record:
+//   TRACE_SYNC, player, seq, rx, dispatch, shown, sent
+// The four stamps are little-endian Usb_timer ticks. shown is 0 if the
+// next frame had nothing new to draw for that player (a key up, a
+// blocked move). sent is when the record was queued, so the host can take
+// our share out of its round trip. Records go out through a TX ring that
+// the main loop feeds into the UART FIFO; the FIFO-empty interrupt wakes
+// it for more.
+// -------------------------------------------
+#define TRACE_SYNC 0xA5
+#define TRACE_RECORD_LEN 19
 
-// stable gravity table
-static const uint32_t gravity_table[] = {
-    50000000, 45000000, 40000000, 35000000, 30000000,
-    25000000, 20000000, 15000000, 10000000, 5000000
-};
+#define TX_RING_SIZE 256 // power of two
+#define TX_RING_MASK (TX_RING_SIZE - 1)
 
-// Returns number of cleared lines
-void clear_lines(Player *p) {
-    // Scan from bottom to top
-    for (int y = BOARD_HEIGHT - 1; y >= 0; y--) {
-        bool full = true;
-        // Check if row y is full
-        for (int x = 0; x < BOARD_WIDTH; x++) {
-            if (p->grid[x][y] == 0) {
-                full = false;
-                break;
-            }
-        }
-        if (full) {
-            // Shift everything above down by 1
-            for (int yy = y; yy > 0; yy--) {
-                for (int x = 0; x < BOARD_WIDTH; x++) {
-                    p->grid[x][yy] = p->grid[x][yy - 1];
-                }
-            }
-            // Top row becomes empty
-            for (int x = 0; x < BOARD_WIDTH; x++) {
-                p->grid[x][0] = 0;
-            }
-            p->lines++;
-            y++;  // re-check the same y index because rows shifted down
-        }
+u8 tx_ring[TX_RING_SIZE];
+uint16_t tx_head = 0;
+uint16_t tx_tail = 0;
+
+uint32_t trace_drops = 0;   // records lost to a full TX ring or trace list
+
+// queues all n bytes for the UART, or none if they do not fit
+bool uart_tx_queue(const u8 *buf, uint16_t n) {
+    if (TX_RING_SIZE - 1 - ((tx_head - tx_tail) & TX_RING_MASK) < n) return false;
+    while (n--) {
+        tx_ring[tx_head] = *buf++;
+        tx_head = (tx_head + 1) & TX_RING_MASK;
     }
-    p->linestot += p->lines;
-    return;
+    return true;
 }
 
-void handle_rotate(Player *p, u8 key, u8 state) {
-    if (state != 1) return;   // rotate only on key-down
+// moves queued bytes into the TX FIFO until it is full
+void uart_tx_pump(void) {
+    while (tx_tail != tx_head &&
+            !(XUartLite_ReadReg(Uart.RegBaseAddress, XUL_STATUS_REG_OFFSET) & XUL_SR_TX_FIFO_FULL)) {
+        XUartLite_WriteReg(Uart.RegBaseAddress, XUL_TX_FIFO_OFFSET, tx_ring[tx_tail]);
+        tx_tail = (tx_tail + 1) & TX_RING_MASK;
+    }
+}
 
-    uint8_t old_rot = p->rot;
+static void put32(u8 *b, uint32_t v) {
+    b[0] = v;
+    b[1] = v >> 8;
+    b[2] = v >> 16;
+    b[3] = v >> 24;
+}
 
-    if (key == KEY_ROTATE_CW) {
-        // clockwise: +1 mod 4
-        p->rot = (p->rot + 1) & 3;
-    }
-    else if (key == KEY_ROTATE_CCW) {
-        // counterclockwise: -1 mod 4
-        p->rot = (p->rot + 3) & 3;   // same as (rot - 1 + 4) % 4
+// stamps a traced event as it is dispatched to p
+void trace_dispatch(Player *p, const InputEvent *ev) {
+    if (ev->seq == 0) return;
+    if (p->trace_count == TRACE_PENDING) {
+        trace_drops++;
+        return;
     }
-    else {
-        return; // not a rotation key
+    LatencyTrace *t = &p->trace[p->trace_count++];
+    t->seq = ev->seq;
+    t->rx = ev->tick;
+    t->dispatch = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+}
+
+// sends a record for each of p's dispatched events, shown being the tick
+// p's board was written at (0 if it was not)
+void trace_flush(Player *p, uint32_t shown) {
+    uint32_t sent = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+    for (uint8_t i = 0; i < p->trace_count; i++) {
+        const LatencyTrace *t = &p->trace[i];
+        u8 rec[TRACE_RECORD_LEN];
+        rec[0] = TRACE_SYNC;
+        rec[1] = p->index + 1;
+        rec[2] = t->seq;
+        put32(rec + 3, t->rx);
+        put32(rec + 7, t->dispatch);
+        put32(rec + 11, shown);
+        put32(rec + 15, sent);
+        if (!uart_tx_queue(rec, TRACE_RECORD_LEN)) trace_drops++;
     }
+    p->trace_count = 0;
+}
 
-    // Check legality
-    if (check_collision(p, p->x, p->y)) {
-        p->rot = old_rot; // revert
+// -------------------------------------------
+// Process one input packet: show its key on the player's keycode GPIO
+// -------------------------------------------
+void process_input_event(u8 player, u8 key) {
+    if (player == 1) {
+        XGpio_DiscreteWrite(&P1KeycodeGpio, 1, key);
+    } else if (player == 2) {
+        XGpio_DiscreteWrite(&P2KeycodeGpio, 1, key);
     }
 }
 
-void handle_softdrop(Player *p, u8 key, u8 state, u8* prev_down)
-{
-    if (key == KEY_SOFTDROP && state == 1) {
 
-        // Rising edge: just pressed now
-        if (*prev_down == 0) {
-            if (!check_collision(p, p->x, p->y + 1)) {
-                p->y++;        // move 1 cell only once per key press
-            }
-        }
+// returns true if collision, false if no collision
+// each piece row is shifted into board position and ANDed with the occupancy
+// row; the wall bits in ROW_EMPTY catch anything hanging off the sides
+bool check_collision(Player *p, int x, int y) {
+    uint16_t mask = PIECE_MASK[p->piece][p->rot];
 
-        *prev_down = 1;   // remember it's held
-    }
-    else {
-        *prev_down = 0;   // key released
-    }
-}
+    // every piece has a cell in matrix columns 0..3, so these always collide
+    if(x < -ROW_WALL_BITS || x >= BOARD_WIDTH) return true;
+    int shift = x + ROW_WALL_BITS;
 
+    for(int j = 0; j < 4; j++) {       // row in tetromino
+        uint8_t row = piece_row(mask, j);
+        if(row == 0) continue;         // empty row, skip
 
-// rising-edge harddrop
-void handle_harddrop_edge(Player *p, u8 key, u8 state, u8 prev_state) {
-    if (key != KEY_HARDDROP) return;
-    if (!(prev_state == 0 && state == 1)) return; // only on 0 -> 1
+        int board_y = y + j;
+        if(board_y < 0 || board_y >= BOARD_HEIGHT) return true;
 
-    // move down until collision
-    while (!check_collision(p, p->x, p->y + 1)) {
-        p->y++;
+        if(((uint16_t)row << shift) & p->rows[board_row(p, board_y)]) return true;
+    }
+
+    return false; // no collision
+}
+
+// returns the row the current piece lands on if dropped straight down from
+// (x, y). The collision column is built once per board/piece and cached,
+// so ghost and hard drop are a shift and a count-trailing-zeros.
+int drop_row(Player *p, int x, int y) {
+    if (p->drop_piece != p->piece) {
+        invalidate_drops(p);
+        p->drop_piece = p->piece;
+    }
+
+    int col = x + ROW_WALL_BITS;
+    uint16_t bit = 1u << col;
+
+    if (!(p->drop_valid[p->rot] & bit)) {
+        // rows past the floor always collide so the mask is never empty
+        uint32_t fit = 0xFFFFFFFFu << BOARD_HEIGHT;
+        for (int yy = 0; yy < BOARD_HEIGHT; yy++) {
+            if (check_collision(p, x, yy)) fit |= 1u << yy;
+        }
+        p->drop_fit[p->rot][col] = fit;
+        p->drop_valid[p->rot] |= bit;
+    }
+
+    // first colliding row below y, minus one
+    return y + __builtin_ctz(p->drop_fit[p->rot][col] >> (y + 1));
+}
+//dont worry about drawing pieces
+void writeboard_raw(Player* p) {
+    mmio_update(p->addr, p->shadow, p->image, BOARD_WORDS);
+}
+
+
+void writeboard(Player* p) {
+    uint32_t frame[BOARD_WORDS];
+    uint16_t mask = PIECE_MASK[p->piece][p->rot];
+    uint8_t color = PIECE_COLOR[p->piece];
+
+    memcpy(frame, p->image, sizeof(frame));
+
+    // Calculate drop position (ghost piece)
+    int drop_y = drop_row(p, p->x, p->y);
+
+    // Ghost piece overlay (only where the board is empty), then the actual
+    // piece on top; each only touches the words its cells fall in
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << (4 * j + i)))) continue;
+            int y = drop_y + j;
+            if (y < BOARD_HEIGHT && image_get(frame, p->x + i, y) == 0) {
+                image_set(frame, p->x + i, y, COLOR_GHOST);
+            }
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << (4 * j + i)))) continue;
+            int y = p->y + j;
+            if (y < BOARD_HEIGHT) {
+                image_set(frame, p->x + i, y, color);
+            }
+        }
+    }
+
+    mmio_update(p->addr, p->shadow, frame, BOARD_WORDS);
+}
+
+
+// -------------------------------------------
+// Zobrist keys
+// A random 64-bit key per cell, per hold piece and per queue position
+// (mod ZOBRIST_QUEUE); a position's key is the XOR of the ones that apply,
+// so placing a piece is four XORs. Filled by zobrist_init.
+// -------------------------------------------
+#define ZOBRIST_QUEUE 16 // power of two
+
+uint64_t zobrist_cell[BOARD_HEIGHT][BOARD_WIDTH];
+uint64_t zobrist_hold[8];          // by hold piece, [7] = empty
+uint64_t zobrist_queue[ZOBRIST_QUEUE];
+
+// key of the cells set in row, a board row at logical y
+static uint64_t zobrist_row(int y, uint16_t row) {
+    uint64_t h = 0;
+    uint16_t cells = row & (uint16_t)~ROW_EMPTY;
+    while (cells) {
+        h ^= zobrist_cell[y][__builtin_ctz(cells) - ROW_WALL_BITS];
+        cells &= cells - 1;
+    }
+    return h;
+}
+
+// key of logical rows y0..y1 of p's board
+static uint64_t board_hash_rows(const Player *p, int y0, int y1) {
+    uint64_t h = 0;
+    for (int y = y0; y <= y1; y++) h ^= zobrist_row(y, p->rows[board_row(p, y)]);
+    return h;
+}
+
+// key of p's whole board, from scratch; p->hash keeps it up to date
+uint64_t board_hash(const Player *p) {
+    return board_hash_rows(p, 0, BOARD_HEIGHT - 1);
+}
+
+// key of a board with hold piece hold and the piece numbered pos to play
+static inline uint64_t zobrist_key(uint64_t board, uint8_t hold, uint32_t pos) {
+    return board ^ zobrist_hold[(hold == EMPTY_HOLD) ? 7 : hold] ^ zobrist_queue[pos & (ZOBRIST_QUEUE - 1)];
+}
+
+void lock_piece(Player* p, int x) {
+    uint16_t mask = PIECE_MASK[p->piece][p->rot];
+    uint8_t color = PIECE_COLOR[p->piece];
+
+    for(int i = 0; i < 4; i++) {       // column in tetromino
+        for(int j = 0; j < 4; j++) {   // row in tetromino
+            if(!(mask & (1 << (4 * j + i)))) continue;
+
+            int board_x = x + i;
+            int board_y = p->y + j;
+
+            // Make sure we are inside board
+            if(board_x >= 0 && board_x < 10 && board_y >= 0 && board_y < 20) {
+                int r = board_row(p, board_y);
+                p->cells[r][board_x] = color;
+                p->rows[r] |= ROW_BIT(board_x);
+                p->hash ^= zobrist_cell[board_y][board_x];
+                image_set(p->image, board_x, board_y, color);
+                p->lock_rows |= 1u << board_y;
+            }
+        }
+    }
+    invalidate_drops(p);
+    p->dirty = true;
+}
+
+
+
+// -------------------------------------------
+// Randomizer
+// xoshiro128**: 16 bytes of state, only shifts, rotates and two cheap
+// multiplies per number. Both players are seeded the same, so they see the
+// same pieces and holes whatever the other one does.
+// -------------------------------------------
+static inline uint32_t rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+uint32_t rng_next(Rng *r) {
+    uint32_t *s = r->s;
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+// advances r by 2^64 numbers, for splitting off a stream that never overlaps
+void rng_jump(Rng *r) {
+    static const uint32_t JUMP[4] = { 0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b };
+    uint32_t t[4] = {0, 0, 0, 0};
+
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 32; b++) {
+            if (JUMP[i] & (1u << b)) {
+                for (int j = 0; j < 4; j++) t[j] ^= r->s[j];
+            }
+            rng_next(r);
+        }
+    }
+    memcpy(r->s, t, sizeof(t));
+}
+
+// fills the state from one 32-bit seed with splitmix32, which never gives
+// the all-zero state xoshiro can't leave
+void rng_seed(Rng *r, uint32_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint32_t z = (seed += 0x9e3779b9);
+        z = (z ^ (z >> 16)) * 0x85ebca6b;
+        z = (z ^ (z >> 13)) * 0xc2b2ae35;
+        r->s[i] = z ^ (z >> 16);
+    }
+}
+
+// uniform 0..k-1 (k >= 1): masks to the next power of two and retries, so
+// there is no modulo bias and no divide
+uint32_t rng_below(Rng *r, uint32_t k) {
+    if (k <= 1) return 0;
+    uint32_t mask = ~0u >> __builtin_clz(k - 1);
+    uint32_t v;
+    do {
+        v = rng_next(r) & mask;
+    } while (v >= k);
+    return v;
+}
+
+// fills the Zobrist keys from a fixed seed, so they are the same every run
+void zobrist_init(void) {
+    Rng r;
+    rng_seed(&r, 0x2b7e1516);
+    for (int y = 0; y < BOARD_HEIGHT; y++) {
+        for (int x = 0; x < BOARD_WIDTH; x++) {
+            zobrist_cell[y][x] = ((uint64_t)rng_next(&r) << 32) | rng_next(&r);
+        }
+    }
+    for (int i = 0; i < 8; i++) zobrist_hold[i] = ((uint64_t)rng_next(&r) << 32) | rng_next(&r);
+    for (int i = 0; i < ZOBRIST_QUEUE; i++) zobrist_queue[i] = ((uint64_t)rng_next(&r) << 32) | rng_next(&r);
+}
+
+// next piece from the player's bag, reshuffling a fresh one when it runs out
+uint8_t next_piece(Player *p) {
+    if (p->bag_left == 0) {
+        for (uint8_t i = 0; i < 7; i++) p->bag[i] = i;
+        for (uint8_t i = 6; i > 0; i--) {
+            uint8_t j = rng_below(&p->piece_rng, i + 1);
+            uint8_t t = p->bag[i];
+            p->bag[i] = p->bag[j];
+            p->bag[j] = t;
+        }
+        p->bag_left = 7;
+    }
+    return p->bag[--p->bag_left];
+}
+
+// seeds the streams and deals the first piece and the preview
+void init_randomizer(Player *p, uint32_t seed) {
+    rng_seed(&p->piece_rng, seed);
+    p->garbage_rng = p->piece_rng;
+    rng_jump(&p->garbage_rng);
+    p->target_rng = p->garbage_rng;
+    rng_jump(&p->target_rng);
+    p->bag_left = 0;
+
+    p->piece = next_piece(p);
+    for (int i = 0; i < 5; i++) {
+        p->next_pieces[i] = next_piece(p);
+    }
+}
+
+//returns true if game over
+bool spawn_new_piece(Player* p) {
+	p->piece = p->next_pieces[0];  // take from the preview
+    p->y = 0;                       // top of board
+    p->x = (BOARD_WIDTH / 2) - 2;   // center horizontally
+    p->rot = 0;
+    p->can_hold = true;           // reset hold ability for new piece
+    p->dirty = true;
+    p->pieces++;
+
+	// shift next_pieces left and fill last from queue
+	for (int i = 0; i < 4; i++) {
+		p->next_pieces[i] = p->next_pieces[i + 1];
+	}
+	p->next_pieces[4] = next_piece(p);
+
+    if (check_collision(p, p->x, p->y)) {
+        // handle game over
+    	return true;
+    }
+    return false;
+}
+
+
+// Runs frames frames of gravity g and moves the piece down by the whole rows
+// that built up, stopping at its landing row (one drop_row lookup, so 20G
+// costs the same as 1G). Locking is handled by the lock timer (see
+// update_timers), not here.
+void apply_gravity(Player* p, uint32_t g, uint32_t frames) {
+    p->gravity_acc += g * frames;
+    uint32_t rows = p->gravity_acc >> G_SHIFT;
+    p->gravity_acc &= G_ONE - 1;
+    if (rows == 0) return;
+
+    int land = drop_row(p, p->x, p->y);
+    int y = (rows > (uint32_t)(land - p->y)) ? land : p->y + (int)rows;
+    if (y != p->y) {
+        p->y = y;
+        p->dirty = true;
+    }
+}
+
+// frames until gravity g adds up to at least one more row; below 1G the
+// gravity timer sleeps through the frames in between
+uint32_t gravity_frames(const Player *p, uint32_t g) {
+    if (g >= G_ONE) return 1;
+    return (G_ONE - p->gravity_acc + g - 1) / g;
+}
+
+// how long one row takes at gravity g, for timing soft drop
+uint32_t gravity_row_ticks(uint32_t g) {
+    return (uint32_t)(((uint64_t)FRAME_TICKS << G_SHIFT) / g);
+}
+
+// moves the piece one column if it fits; returns false if blocked
+bool shift_piece(Player *p, int dx) {
+    if (check_collision(p, p->x + dx, p->y)) return false;
+
+    p->x += dx;
+    p->dirty = true;
+    // Reset lock delay if piece can now move down
+    if (!check_collision(p, p->x, p->y + 1)) {
+        p->lock_delay_active = false;
+    }
+    return true;
+}
+
+void handle_left(Player *p) {
+    shift_piece(p, -1);
+}
+
+void handle_right(Player *p) {
+    shift_piece(p, 1);
+}
+
+
+// gravity per level in G; the first ten keep the old 30, 27, ... 3 frames
+// per row, then it climbs to 20G
+static const uint32_t gravity_table[] = {
+    G_ONE / 30, G_ONE / 27, G_ONE / 24, G_ONE / 21, G_ONE / 18,
+    G_ONE / 15, G_ONE / 12, G_ONE / 9,  G_ONE / 6,  G_ONE / 3,
+    G_ONE / 2,  G_ONE,      2 * G_ONE,  5 * G_ONE,  G_MAX
+};
+#define NUM_LEVELS (sizeof(gravity_table) / sizeof(gravity_table[0]))
+
+// copies logical row src over logical row dst
+static void copy_row(Player *p, int dst, int src) {
+    int d = board_row(p, dst);
+    int r = board_row(p, src);
+    memcpy(p->cells[d], p->cells[r], BOARD_WIDTH);
+    p->rows[d] = p->rows[r];
+}
+
+// Clears full rows, looking only at the rows the last lock_piece touched.
+// Survivors are compacted in one pass from whichever side of the cleared
+// rows holds fewer of them; clearing from the bottom of the stack only
+// moves base. Returns number of cleared lines; if cleared is non-NULL it
+// receives a bitmask of the cleared row indices (as they were before the clear).
+uint8_t clear_lines(Player *p, uint32_t *cleared) {
+    uint32_t touched = p->lock_rows;
+    uint32_t full = 0;
+    uint8_t count = 0;
+    int highest = BOARD_HEIGHT;
+    int lowest = -1;
+
+    p->lock_rows = 0;
+
+    while (touched) {
+        int y = __builtin_ctz(touched);
+        touched &= touched - 1;
+        if (p->rows[board_row(p, y)] == ROW_FULL) {
+            full |= 1u << y;
+            count++;
+            if (y < highest) highest = y;
+            lowest = y;
+        }
+    }
+
+    if (cleared) *cleared = full;
+    if (count == 0) return 0;
+
+    // rows under the lowest cleared one keep their place, so only the key
+    // of rows 0..lowest changes
+    p->hash ^= board_hash_rows(p, 0, lowest);
+
+    int above = lowest + 1 - count;        // survivors that would move down
+    int below = BOARD_HEIGHT - highest - count; // survivors that would move up
+
+    if (above <= below) {
+        // walk up from the lowest cleared row, moving each surviving row
+        // down by the number of cleared rows beneath it
+        int dst = lowest;
+        for (int src = lowest; src >= 0; src--) {
+            if (full & (1u << src)) continue;
+            if (dst != src) copy_row(p, dst, src);
+            dst--;
+        }
+    } else {
+        // pull the rows under the cleared ones up, leaving the free slots at
+        // the bottom, then rotate the ring so those slots become the top
+        int dst = highest;
+        for (int src = highest; src < BOARD_HEIGHT; src++) {
+            if (full & (1u << src)) continue;
+            if (dst != src) copy_row(p, dst, src);
+            dst++;
+        }
+        p->base = board_row(p, BOARD_HEIGHT - count);
+    }
+
+    // top rows become empty
+    for (int y = 0; y < count; y++) {
+        int r = board_row(p, y);
+        memset(p->cells[r], 0, BOARD_WIDTH);
+        p->rows[r] = ROW_EMPTY;
+    }
+    p->hash ^= board_hash_rows(p, 0, lowest);
+
+    pack_image(p);
+    invalidate_drops(p);
+    p->dirty = true;
+    p->linestot += count;
+    return count;
+}
+
+// moves the piece down one row if it fits; returns false if blocked
+bool soft_step(Player *p) {
+    if (check_collision(p, p->x, p->y + 1)) return false;
+    p->y++;
+    p->dirty = true;
+    return true;
+}
+
+void handle_softdrop(Player *p)
+{
+    soft_step(p);
+}
+
+
+// turns the piece a quarter turn, dir 1 = clockwise, 3 = counterclockwise,
+// at the first wall kick that fits; stays put if none does
+void rotate_piece(Player *p, uint8_t dir) {
+    Kick kick[KICK_TESTS];
+    piece_kicks(p->piece, p->rot, dir, kick);
+    int tests = (p->piece == PIECE_O) ? 1 : KICK_TESTS;
+    uint8_t old_rot = p->rot;
+
+    p->rot = (p->rot + dir) & 3;
+    for (int i = 0; i < tests; i++) {
+        int x = p->x + kick[i].x;
+        int y = p->y + kick[i].y;
+        if (check_collision(p, x, y)) continue;
+
+        p->x = x;
+        p->y = y;
+        p->dirty = true;
+        // Successful rotation - reset lock delay if piece can now move down
+        if (!check_collision(p, p->x, p->y + 1)) {
+            p->lock_delay_active = false;
+        }
+        return;
+    }
+    p->rot = old_rot;
+}
+
+void handle_rotate_cw(Player *p) {
+    rotate_piece(p, 1);
+}
+
+void handle_rotate_ccw(Player *p) {
+    rotate_piece(p, 3);
+}
+
+void apply_garbage(Player *p, uint8_t amount) {
+    int hole = rng_below(&p->garbage_rng, BOARD_WIDTH);
+    while (amount--) {
+        if(p->game->mods.messy_garbage){
+            hole = rng_below(&p->garbage_rng, BOARD_WIDTH);
+        }
+        // shift board up: the old top row's slot becomes the new bottom row
+        p->base = board_row(p, 1);
+
+        // make bottom row garbage
+        int r = board_row(p, BOARD_HEIGHT - 1);
+        for (int x = 0; x < 10; x++) {
+            p->cells[r][x] = (x == hole) ? 0 : COLOR_GARB;  // 8 = garbage color
+        }
+        p->rows[r] = ROW_FULL & ~ROW_BIT(hole);
+
+
+        p->y--;
+        p->lock_rows >>= 1;  // pending rows moved up with the board
+
+        if (p->y < 0) {
+            p->y = 0;  // clamp to top
+
+        }
+    }
+    p->hash = board_hash(p);  // every row moved
+    pack_image(p);
+    invalidate_drops(p);
+    p->dirty = true;
+}
+
+uint32_t line_score(uint8_t lines) {
+    switch(lines) {
+        case 1: return 100;
+        case 2: return 300;
+        case 3: return 500;
+        case 4: return 800;
+        default: return 0;
+    }
+}
+
+uint8_t garbage_from_lines(uint8_t lines) {
+    switch (lines) {
+        case 2: return 1;
+        case 3: return 2;
+        case 4: return 4;
+        default: return 0;
+    }
+}
+
+// queues an attack against p; when the queue is full it piles onto the
+// newest entry so no lines are lost
+void queue_garbage(Player *p, uint8_t amount) {
+    if (p->garbage_count == GARBAGE_QUEUE_LEN) {
+        uint8_t last = (p->garbage_head + GARBAGE_QUEUE_LEN - 1) % GARBAGE_QUEUE_LEN;
+        p->garbage_queue[last] += amount;
+        return;
+    }
+    uint8_t tail = (p->garbage_head + p->garbage_count) % GARBAGE_QUEUE_LEN;
+    p->garbage_queue[tail] = amount;
+    p->garbage_count++;
+}
+
+// Sends amount lines of garbage from p as the game's AttackPolicy says.
+// Opponents are considered in slot order starting after p, so TARGET_NEXT
+// and the split remainder rotate fairly around the table.
+void route_attack(Player *p, uint8_t amount) {
+    Game *g = p->game;
+    if (g->mods.no_garbage) return;
+
+    if (g->attack.counter) {
+        // cancel our own incoming garbage first, oldest first
+        while (amount > 0 && p->garbage_count > 0) {
+            uint8_t *q = &p->garbage_queue[p->garbage_head];
+            uint8_t n = (*q < amount) ? *q : amount;
+            *q -= n;
+            amount -= n;
+            if (*q == 0) {
+                p->garbage_head = (p->garbage_head + 1) % GARBAGE_QUEUE_LEN;
+                p->garbage_count--;
+            }
+        }
+    }
+    if (amount == 0) return;
+
+    Player *targets[MAX_PLAYERS];
+    uint8_t n = 0;
+    uint8_t i = p->index;
+    for (uint8_t k = 1; k < g->num_players; k++) {
+        if (++i == g->num_players) i = 0;
+        if (g->players[i].alive) targets[n++] = &g->players[i];
+    }
+    if (n == 0) return;
+
+    if (g->attack.split) {
+        uint8_t share = amount / n;
+        uint8_t extra = amount % n;
+        for (uint8_t k = 0; k < n; k++) {
+            uint8_t lines = share + (k < extra);
+            if (lines > 0) queue_garbage(targets[k], lines);
+        }
+        return;
+    }
+
+    Player *t = targets[0];
+    if (g->attack.target == TARGET_RANDOM) {
+        t = targets[rng_below(&p->target_rng, n)];
+    } else if (g->attack.target == TARGET_LEADER) {
+        for (uint8_t k = 1; k < n; k++) {
+            if (targets[k]->score > t->score) t = targets[k];
+        }
+    }
+    queue_garbage(t, amount);
+}
+
+// Locks the piece where it is and runs the attack stage right away: the
+// clear is scored and sent by its own line count, then anything queued
+// against us goes in before the next piece spawns. Returns true if the
+// next piece has no room, which knocks p out of the match.
+bool lock_and_spawn(Player *p) {
+    lock_piece(p, p->x);
+    p->lock_delay_active = false;
+
+    uint8_t cleared = clear_lines(p, NULL);
+    p->score += line_score(cleared);
+
+    uint8_t attack = garbage_from_lines(cleared);
+    if (attack > 0) route_attack(p, attack);
+
+    while (p->garbage_count > 0) {
+        apply_garbage(p, p->garbage_queue[p->garbage_head]);
+        p->garbage_head = (p->garbage_head + 1) % GARBAGE_QUEUE_LEN;
+        p->garbage_count--;
+    }
+
+    if (spawn_new_piece(p)) {
+        p->alive = false;
+        return true;
+    }
+    return false;
+}
+
+
+void handle_harddrop(Player *p) {
+    // move down until collision
+    p->y = drop_row(p, p->x, p->y);
+    lock_and_spawn(p);
+}
+
+void handle_hold(Player* p) {
+    if(p->game->mods.no_hold){
+        return;
+    }
+    if (!p->can_hold){ //I want to make this so that the piece gets grayed out when you can no longer use hold
+    	return;                     // only once per piece
+    }
+
+    uint8_t temp = p->piece;
+    if (p->hold_piece == EMPTY_HOLD) {
+        // no held piece yet
+        p->hold_piece = temp;
+        spawn_new_piece(p);
+    } else {
+        // swap current and held piece
+        p->piece = p->hold_piece;
+        p->hold_piece = temp;
+        p->y = 0;
+        p->x = (BOARD_WIDTH / 2) - 2;
+        p->rot = 0;
+
+    }
+    p->can_hold = false; // cannot hold again until next piece
+    p->dirty = true;
+}
+
+typedef void (*ActionHandler)(Player *p);
+
+// indexed by action; ACTION_NONE has no handler
+const ActionHandler ACTION_HANDLERS[NUM_ACTIONS] = {
+    [ACTION_LEFT]       = handle_left,
+    [ACTION_RIGHT]      = handle_right,
+    [ACTION_SOFTDROP]   = handle_softdrop,
+    [ACTION_HARDDROP]   = handle_harddrop,
+    [ACTION_ROTATE_CW]  = handle_rotate_cw,
+    [ACTION_ROTATE_CCW] = handle_rotate_ccw,
+    [ACTION_HOLD]       = handle_hold,
+};
+
+// Runs every auto-repeat step that is due up to tick now. Steps are
+// scheduled from the key-down tick, not from when this gets called, so the
+// number of shifts is the same however fast the main loop spins.
+void auto_repeat(Player *p, uint32_t now) {
+    const RepeatConfig *cfg = &p->game->repeat;
+
+    if (p->shift_dir != 0) {
+        if (!p->shift_charged) {
+            if ((uint32_t)(now - p->shift_last) >= cfg->das_ticks) {
+                p->shift_charged = true;
+                p->shift_last += cfg->das_ticks;
+                shift_piece(p, p->shift_dir);
+            }
+        }
+        if (p->shift_charged) {
+            if (cfg->arr_ticks == 0) {
+                while (shift_piece(p, p->shift_dir)) {}
+            } else {
+                while ((uint32_t)(now - p->shift_last) >= cfg->arr_ticks) {
+                    p->shift_last += cfg->arr_ticks;
+                    if (!shift_piece(p, p->shift_dir)) {
+                        p->shift_last = now; // against the wall, nothing to catch up
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    if (p->held & (1 << ACTION_SOFTDROP)) {
+        if (p->soft_interval == 0) {
+            int drop_y = drop_row(p, p->x, p->y);
+            if (drop_y != p->y) {
+                p->y = drop_y;
+                p->dirty = true;
+            }
+        } else {
+            while ((uint32_t)(now - p->soft_last) >= p->soft_interval) {
+                p->soft_last += p->soft_interval;
+                if (!soft_step(p)) {
+                    p->soft_last = now;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// starts or stops auto-repeat for a left/right/soft drop key change at tick
+void repeat_key(Player *p, uint8_t action, bool down, uint32_t tick) {
+    if (action == ACTION_LEFT || action == ACTION_RIGHT) {
+        int8_t dir = (action == ACTION_LEFT) ? -1 : 1;
+        uint8_t other = (action == ACTION_LEFT) ? ACTION_RIGHT : ACTION_LEFT;
+
+        if (down) {
+            // newest direction wins
+            p->shift_dir = dir;
+        } else if (p->shift_dir == dir) {
+            // fall back to the other direction if it is still held
+            p->shift_dir = (p->held & (1 << other)) ? -dir : 0;
+        } else {
+            return;
+        }
+        p->shift_charged = false;
+        p->shift_last = tick;
+    } else if (action == ACTION_SOFTDROP && down) {
+        uint8_t sdf = p->game->repeat.sdf;
+        p->soft_interval = (sdf == SDF_INSTANT) ? 0 : p->game->gravity_ticks / sdf;
+        p->soft_last = tick;
+    }
+}
+
+// runs every queued event for p, oldest first, then any auto-repeat due by
+// now. The key bitmap turns the event stream into edges (host key repeats
+// are dropped there), and each key-down fires the action bound to that key.
+void dispatch_input(Player *p, uint32_t now) {
+    InputEvent ev;
+    while (input_pop(&p->input, &ev)) {
+        trace_dispatch(p, &ev);
+        if (!key_update(p->keys_down, ev.key, ev.state)) continue;
+
+        // repeats that were due before this event happen first
+        auto_repeat(p, ev.tick);
+
+        uint8_t action = KEY_BINDINGS[ev.key];
+        if (action == ACTION_NONE) continue;
+
+        if (ev.state == 1) {
+            p->held |= 1 << action;
+            ACTION_HANDLERS[action](p);
+        } else {
+            p->held &= ~(1 << action);
+        }
+        repeat_key(p, action, ev.state == 1, ev.tick);
+    }
+    auto_repeat(p, now);
+}
+
+// Re-arms p's lock and auto-repeat timers after its state changed at
+// tick now. The lock delay starts the moment the piece touches down and is
+// cancelled if it can fall again.
+void update_timers(Player *p, uint32_t now) {
+    Scheduler *sched = &p->game->sched;
+    const RepeatConfig *cfg = &p->game->repeat;
+    uint8_t lock_id = TIMER_ID(p->index, TIMER_LOCK);
+    uint8_t repeat_id = TIMER_ID(p->index, TIMER_REPEAT);
+
+    if (check_collision(p, p->x, p->y + 1)) {
+        if (!p->lock_delay_active) {
+            p->lock_delay_active = true;
+            p->lock_delay_start = now;
+            sched_set(sched, lock_id, now + LOCK_DELAY_TICKS);
+        }
+    } else {
+        p->lock_delay_active = false;
+        sched_cancel(sched, lock_id);
+    }
+
+    // next auto-repeat step, if one is pending
+    bool repeat = false;
+    uint32_t next = 0;
+    if (p->shift_dir != 0 && !(p->shift_charged && cfg->arr_ticks == 0)) {
+        next = p->shift_last + (p->shift_charged ? cfg->arr_ticks : cfg->das_ticks);
+        repeat = true;
+    }
+    if ((p->held & (1 << ACTION_SOFTDROP)) && p->soft_interval != 0) {
+        uint32_t soft = p->soft_last + p->soft_interval;
+        if (!repeat || (int32_t)(soft - next) < 0) next = soft;
+        repeat = true;
+    }
+    if (repeat) {
+        sched_set(sched, repeat_id, next);
+    } else {
+        sched_cancel(sched, repeat_id);
+    }
+}
+
+// Works out gravity from the level, one level per 10 lines with both
+// players' clears counted together. Takes effect from each player's next
+// gravity deadline.
+void update_gravity(Game *g, uint32_t total_lines) {
+    g->seen_lines = total_lines;
+
+    uint32_t level = total_lines / 10;
+    if (level > NUM_LEVELS - 1) level = NUM_LEVELS - 1;
+    g->gravity = gravity_table[level];
+
+    if(g->mods.fast_grav){
+        g->gravity *= 2;
+        if (g->gravity > G_MAX) g->gravity = G_MAX;
+    }
+    g->gravity_ticks = gravity_row_ticks(g->gravity);
+}
+
+// Sets up a match once the mods are picked: empty boards, every player dealt
+// from the same seed (identical pieces and garbage holes), gravity armed
+// from tick now. Each player's output fields (addr, shadow, ...) are left
+// to the caller.
+void start_game(Game *g, uint32_t seed, uint32_t now) {
+    g->repeat = REPEAT_DEFAULTS;
+    g->attack = ATTACK_DEFAULTS;
+    zobrist_init();
+    g->num_players = g->mods.single_player ? 2 : MAX_PLAYERS; // single player: P2 is the bot
+    update_gravity(g, 0);
+    sched_init(&g->sched);
+
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        Player *p = &g->players[i];
+        p->game = g;
+        p->index = i;
+        p->alive = (i < g->num_players);
+        init_randomizer(p, seed);
+        clear_board(p);
+    }
+
+    for (uint8_t i = 0; i < g->num_players; i++) {
+        Player *p = &g->players[i];
+        p->gravity_frames = gravity_frames(p, g->gravity);
+        sched_set(&g->sched, TIMER_ID(i, TIMER_GRAVITY), now + p->gravity_frames * FRAME_TICKS);
+    }
+}
+
+// Advances the match to tick now: every live player's queued input and
+// held-key auto-repeat, then every timer (gravity, lock delay, auto-repeat)
+// that has come due, each run as of its own deadline. A player whose next
+// piece has no room drops out; returns true once the match is over (one
+// player left).
+bool game_step(Game *g, uint32_t now) {
+    for (uint8_t i = 0; i < g->num_players; i++) {
+        Player *p = &g->players[i];
+        if (!p->alive) continue;
+        dispatch_input(p, now);
+        update_timers(p, now);
+    }
+
+    uint8_t id;
+    uint32_t when;
+    while (sched_pop_due(&g->sched, now, &id, &when)) {
+        Player *p = &g->players[TIMER_PLAYER(id)];
+        if (!p->alive) continue;
+
+        switch (TIMER_KIND(id)) {
+        case TIMER_GRAVITY:
+            apply_gravity(p, g->gravity, p->gravity_frames);
+            p->gravity_frames = gravity_frames(p, g->gravity);
+            sched_set(&g->sched, id, when + p->gravity_frames * FRAME_TICKS);
+            break;
+        case TIMER_LOCK:
+            // Lock delay expired - lock the piece
+            lock_and_spawn(p);
+            break;
+        case TIMER_REPEAT:
+            auto_repeat(p, when);
+            break;
+        }
+        update_timers(p, when);
+    }
+
+    // clears are scored and sent at lock time (lock_and_spawn); what is left
+    // here is the level and who is still in
+    uint32_t total_lines = 0;
+    uint8_t alive = 0;
+    for (uint8_t i = 0; i < g->num_players; i++) {
+        Player *p = &g->players[i];
+        total_lines += p->linestot;
+        if (p->alive) {
+            alive++;
+        } else {
+            for (uint8_t kind = 0; kind < TIMER_KINDS; kind++) {
+                sched_cancel(&g->sched, TIMER_ID(i, kind));
+            }
+        }
+    }
+    if (total_lines != g->seen_lines) update_gravity(g, total_lines);
+
+    return alive < 2;
+}
+
+// -------------------------------------------
+// Snapshots
+// Everything a match needs to carry on from some tick: the timers, gravity
+// and each player's state prefix (see Player). Fixed size, no pointers, so
+// saving is a few memcpys; restoring rebuilds the packed image and drops
+// the landing caches. Only built with ROLLBACK, as is the driver below.
+// -------------------------------------------
+#ifdef ROLLBACK
+typedef struct {
+    Scheduler sched;
+    uint32_t gravity;
+    uint32_t gravity_ticks;
+    uint32_t seen_lines;
+    uint8_t players[MAX_PLAYERS][PLAYER_STATE_SIZE];
+} Snapshot;
+
+void game_save(const Game *g, Snapshot *s) {
+    s->sched = g->sched;
+    s->gravity = g->gravity;
+    s->gravity_ticks = g->gravity_ticks;
+    s->seen_lines = g->seen_lines;
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        memcpy(s->players[i], &g->players[i], PLAYER_STATE_SIZE);
     }
-    lock_piece(p, p->x);
-    clear_lines(p);
-    spawn_new_piece(p);
 }
 
-void handle_rotate_edge(Player *p, u8 key, u8 state, u8 prev_state) {
-    if (!(prev_state == 0 && state == 1)) return;
-    uint8_t old_rot = p->rot;
-    if (key == KEY_ROTATE_CW) {
-        p->rot = (p->rot + 1) & 3;
-    } else if (key == KEY_ROTATE_CCW) {
-        p->rot = (p->rot + 3) & 3;
-    } else {
+// Puts g back to s. Queued input is thrown away, it belongs to the timeline
+// being undone.
+void game_restore(Game *g, const Snapshot *s) {
+    g->sched = s->sched;
+    g->gravity = s->gravity;
+    g->gravity_ticks = s->gravity_ticks;
+    g->seen_lines = s->seen_lines;
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        Player *p = &g->players[i];
+        memcpy(p, s->players[i], PLAYER_STATE_SIZE);
+        pack_image(p);
+        p->hash = board_hash(p);
+        invalidate_drops(p);
+        p->input.head = p->input.tail = 0;
+        p->dirty = true;
+    }
+}
+
+// -------------------------------------------
+// Rollback netplay driver
+// The match runs in fixed frames of FRAME_TICKS. Each frame both players'
+// input is a mask of held ACTION_* bits. Ours is taken RB_INPUT_DELAY frames
+// ahead and handed to send; the remote's arrives late through
+// rollback_remote, and until it does we assume they kept holding what they
+// last sent. When a real mask differs from the guess, the next
+// rollback_advance restores the snapshot from that frame and replays up to
+// now. We never run more than RB_WINDOW frames past the remote's input,
+// so a snapshot to go back to always exists.
+// -------------------------------------------
+#define RB_WINDOW 8          // frames we can roll back
+#define RB_INPUT_DELAY 2     // frames our own input waits, hides short lag
+#define RB_HISTORY 16        // input ring, power of two > RB_WINDOW + RB_INPUT_DELAY
+#define RB_MASK (RB_HISTORY - 1)
+
+typedef void (*RollbackSend)(void *ctx, uint32_t frame, uint8_t actions);
+
+typedef struct {
+    Game *game;
+    uint8_t local;                    // our player slot, the other is remote
+    uint32_t start;                   // tick frame 0 starts at
+    uint32_t frame;                   // next frame to simulate
+    uint32_t sampled;                 // local input set for frames < sampled
+    uint32_t received;                // remote input known for frames < received
+    uint32_t rewind;                  // earliest mispredicted frame, or frame if none
+    uint32_t local_keys[8];           // our held keys, see rollback_key
+    uint8_t input[MAX_PLAYERS][RB_HISTORY];  // action mask by frame
+    uint8_t guessed[RB_HISTORY];      // remote mask each frame was last run with
+    Snapshot snap[RB_WINDOW];         // state at the start of frame f, at f % RB_WINDOW
+    RollbackSend send;
+    void *send_ctx;
+
+    // stats, readable from the debugger
+    uint32_t rollbacks;
+    uint32_t resim_frames;
+    uint32_t worst_resim_ticks;       // longest rollback_advance replay
+    uint32_t stalls;                  // frames held back waiting on the remote
+} Rollback;
+
+// call after start_game; frame 0 starts at tick start
+void rollback_init(Rollback *rb, Game *g, uint8_t local, uint32_t start,
+        RollbackSend send, void *send_ctx) {
+    memset(rb, 0, sizeof(*rb));
+    rb->game = g;
+    rb->local = local;
+    rb->start = start;
+    rb->send = send;
+    rb->send_ctx = send_ctx;
+}
+
+// our own key packets go here instead of into the player's input queue
+void rollback_key(Rollback *rb, u8 key, u8 state) {
+    key_update(rb->local_keys, key, state);
+}
+
+// The remote's mask for frame f. Masks must come in frame order (a
+// reliable link); anything else is ignored. Returns false for a mask too
+// far ahead to store yet: its ring slot still holds a frame a rollback may
+// replay (the last RB_WINDOW) or has not run. The link keeps it and offers
+// it again after the next rollback_advance.
+bool rollback_remote(Rollback *rb, uint32_t f, uint8_t actions) {
+    if (f != rb->received) return true;
+    if ((int32_t)(f - rb->frame) >= RB_HISTORY - RB_WINDOW) return false;
+    rb->input[!rb->local][f & RB_MASK] = actions;
+    rb->received++;
+    if (f < rb->frame && actions != rb->guessed[f & RB_MASK] && f < rb->rewind) {
+        rb->rewind = f;
+    }
+    return true;
+}
+
+// the ACTION_* mask a pressed-key bitmap holds down
+static uint8_t actions_down(const uint32_t keys[8]) {
+    uint8_t actions = 0;
+    for (uint8_t a = ACTION_NONE + 1; a < NUM_ACTIONS; a++) {
+        u8 key = ACTION_KEYS[a];
+        if (keys[key >> 5] & (1u << (key & 31))) actions |= 1 << a;
+    }
+    return actions;
+}
+
+// player i's mask for frame f: real if we have it, otherwise the guess
+static uint8_t rb_actions(Rollback *rb, uint8_t i, uint32_t f) {
+    if (i == rb->local || f < rb->received) return rb->input[i][f & RB_MASK];
+    return rb->received ? rb->input[i][(rb->received - 1) & RB_MASK] : 0;
+}
+
+// runs frame rb->frame: save, feed both players' input as key edges against
+// what they hold now, step the game to the frame's tick
+static bool rb_run_frame(Rollback *rb) {
+    Game *g = rb->game;
+    uint32_t f = rb->frame;
+    uint32_t tick = rb->start + f * FRAME_TICKS;
+
+    game_save(g, &rb->snap[f % RB_WINDOW]);
+
+    for (uint8_t i = 0; i < g->num_players; i++) {
+        uint8_t now = rb_actions(rb, i, f);
+        uint8_t changed = now ^ actions_down(g->players[i].keys_down);
+        if (i != rb->local) rb->guessed[f & RB_MASK] = now;
+
+        while (changed) {
+            uint8_t a = __builtin_ctz(changed);
+            changed &= changed - 1;
+            input_push(&g->players[i].input, ACTION_KEYS[a], (now >> a) & 1, 0, tick);
+        }
+    }
+
+    rb->frame++;
+    return game_step(g, tick);
+}
+
+// Catches the match up to tick now, replaying from a mispredicted frame
+// first if there is one. Returns true on game over.
+bool rollback_advance(Rollback *rb, uint32_t now) {
+    bool gameover = false;
+
+    if (rb->rewind < rb->frame) {
+        uint32_t t0 = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+        uint32_t target = rb->frame;
+
+        game_restore(rb->game, &rb->snap[rb->rewind % RB_WINDOW]);
+        rb->rollbacks++;
+        rb->resim_frames += target - rb->rewind;
+        rb->frame = rb->rewind;
+        while (rb->frame < target) gameover |= rb_run_frame(rb);
+
+        uint32_t spent = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER) - t0;
+        if (spent > rb->worst_resim_ticks) rb->worst_resim_ticks = spent;
+    }
+
+    while ((int32_t)(now - (rb->start + rb->frame * FRAME_TICKS)) >= 0) {
+        // signed: the remote's input is usually ahead of us
+        if ((int32_t)(rb->frame - rb->received) >= RB_WINDOW) {
+            rb->stalls++;
+            break;
+        }
+        while (rb->sampled <= rb->frame + RB_INPUT_DELAY) {
+            uint8_t actions = actions_down(rb->local_keys);
+            rb->input[rb->local][rb->sampled & RB_MASK] = actions;
+            if (rb->send) rb->send(rb->send_ctx, rb->sampled, actions);
+            rb->sampled++;
+        }
+        gameover |= rb_run_frame(rb);
+    }
+    rb->rewind = rb->frame;
+    return gameover;
+}
+#endif
+
+// -------------------------------------------
+// Two-peer check of the driver, only built with ROLLBACK_SELFTEST. Two
+// matches plus their snapshots do not fit next to the real one, so it runs
+// on a host build: `make` in ../host.
+// Both peers run on one machine over an in-order loopback link standing in
+// for the socket: a mask is delivered latency frames after it was sent, and
+// one rollback_remote refuses waits in the link like unread socket data.
+// Each peer presses keys from its own script, and peer 1's clock can run
+// skew frames behind so peer 0 gets ahead and is refused. Per run this prints the
+// frame each reached, their stalls, rollbacks and refused masks, and whether
+// both ended in the same state.
+// -------------------------------------------
+#ifdef ROLLBACK_SELFTEST
+#define RB_TEST_FRAMES 600
+#define RB_LINK_LEN 64       // > masks in flight at the largest latency
+
+typedef struct {
+    uint32_t frame[RB_LINK_LEN];
+    uint8_t actions[RB_LINK_LEN];
+    uint32_t due[RB_LINK_LEN];        // test frame it is delivered at
+    uint8_t head, tail;
+    uint32_t latency;
+    uint32_t now;                     // current test frame
+    uint32_t refused;                 // deliveries rollback_remote turned down
+    bool overflow;
+} RbLink;
+
+static void rb_link_send(void *ctx, uint32_t f, uint8_t actions) {
+    RbLink *l = ctx;
+    uint8_t next = (l->head + 1) % RB_LINK_LEN;
+    if (next == l->tail) {
+        l->overflow = true;
         return;
     }
-    if (check_collision(p, p->x, p->y)) {
-        p->rot = old_rot;
-    } else {
-        // Successful rotation - reset lock delay if piece can now move down
-        if (!check_collision(p, p->x, p->y + 1)) {
-            p->lock_delay_active = false;
+    l->frame[l->head] = f;
+    l->actions[l->head] = actions;
+    l->due[l->head] = l->now + l->latency;
+    l->head = next;
+}
+
+// hands over every mask that is due, stopping at the first one refused
+static void rb_link_deliver(RbLink *l, Rollback *rb) {
+    while (l->tail != l->head && (int32_t)(l->now - l->due[l->tail]) >= 0) {
+        if (!rollback_remote(rb, l->frame[l->tail], l->actions[l->tail])) {
+            l->refused++;
+            break;
         }
+        l->tail = (l->tail + 1) % RB_LINK_LEN;
     }
 }
-void apply_garbage(Player *p, uint8_t amount) {
-    int hole = simple_rand(10);
-    while (amount--) {
-        // shift board up
-        if(mods.messy_garbage){
-            hole = simple_rand(10);
+
+static Game rb_test_game[2];
+static Rollback rb_test_rb[2];
+static RbLink rb_test_link[2];        // [i] carries peer i's masks to the other
+static uint32_t rb_test_fb[2][MAX_PLAYERS][BOARD_WORDS];
+static uint32_t rb_test_shadow[2][MAX_PLAYERS][BOARD_WORDS];
+static Snapshot rb_test_snap[2];
+
+// one match with both links latency frames long and peer 1's clock skew
+// frames behind; true if both peers got through it in step
+static bool rb_selftest_run(uint32_t latency, uint32_t skew) {
+    static const u8 keys[] = {KEY_LEFT, KEY_RIGHT, KEY_ROTATE_CW, KEY_ROTATE_CCW,
+            KEY_SOFTDROP, KEY_HARDDROP, KEY_HOLD};
+    uint32_t script[2] = {1, 2};
+
+    for (uint8_t k = 0; k < 2; k++) {
+        Game *g = &rb_test_game[k];
+        memset(g, 0, sizeof(*g));
+        for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+            g->players[i] = (Player){
+                .addr = rb_test_fb[k][i],
+                .shadow = rb_test_shadow[k][i],
+                .x = 3,
+                .hold_piece = EMPTY_HOLD,
+                .can_hold = true
+            };
         }
-        for (int y = 0; y < 19; y++) {
-            for (int x = 0; x < 10; x++) {
-                p->grid[x][y] = p->grid[x][y + 1];
+        start_game(g, 1234, 0);
+        memset(&rb_test_link[k], 0, sizeof(RbLink));
+        rb_test_link[k].latency = latency;
+        rollback_init(&rb_test_rb[k], g, k, 0, rb_link_send, &rb_test_link[k]);
+    }
+
+    // the match, then each peer's clock stops on the last frame while the
+    // links run on, until both have reached it with no guessed frame left
+    // (past RB_WINDOW of latency they stall and fall behind, so that can
+    // take a while)
+    Rollback *a = &rb_test_rb[0], *b = &rb_test_rb[1];
+    bool settled = false;
+    for (uint32_t t = 0; t < RB_TEST_FRAMES + skew || (!settled && t < 8 * RB_TEST_FRAMES); t++) {
+        for (uint8_t k = 0; k < 2; k++) {
+            rb_test_link[k].now = t;
+            script[k] = script[k] * 1103515245 + 12345;
+            if (t < RB_TEST_FRAMES && (script[k] >> 16) % 6 == 0) {
+                rollback_key(&rb_test_rb[k], keys[(script[k] >> 20) % sizeof(keys)],
+                        (script[k] >> 8) & 1);
             }
         }
+        rb_link_deliver(&rb_test_link[0], b);
+        rb_link_deliver(&rb_test_link[1], a);
+        for (uint8_t k = 0; k < 2; k++) {
+            uint32_t f = k ? (t > skew ? t - skew : 0) : t;
+            if (f > RB_TEST_FRAMES - 1) f = RB_TEST_FRAMES - 1;
+            rollback_advance(&rb_test_rb[k], f * FRAME_TICKS);
+        }
+        settled = a->frame == RB_TEST_FRAMES && b->frame == RB_TEST_FRAMES
+                && a->received >= a->frame && b->received >= b->frame;
+    }
 
-        // make bottom row garbage
-        for (int x = 0; x < 10; x++) {
-            p->grid[x][19] = (x == hole) ? 0 : COLOR_GARB;  // 8 = garbage color
+    // padding included, so start both from zero
+    for (uint8_t k = 0; k < 2; k++) {
+        memset(&rb_test_snap[k], 0, sizeof(Snapshot));
+        game_save(&rb_test_game[k], &rb_test_snap[k]);
+    }
+    bool same = memcmp(&rb_test_snap[0], &rb_test_snap[1], sizeof(Snapshot)) == 0;
+    bool ok = settled && same
+            && !rb_test_link[0].overflow && !rb_test_link[1].overflow
+            && (latency + skew > 0 || a->stalls + b->stalls == 0);
+
+    printf("rollback latency %lu skew %lu: frames %lu/%lu stalls %lu/%lu rollbacks %lu/%lu"
+            " refused %lu/%lu %s\r\n",
+            (unsigned long)latency, (unsigned long)skew,
+            (unsigned long)a->frame, (unsigned long)b->frame,
+            (unsigned long)a->stalls, (unsigned long)b->stalls,
+            (unsigned long)a->rollbacks, (unsigned long)b->rollbacks,
+            (unsigned long)rb_test_link[1].refused, (unsigned long)rb_test_link[0].refused,
+            ok ? "ok" : same ? "FAIL" : "FAIL, states differ");
+    return ok;
+}
+
+// a few latencies either side of what RB_WINDOW and RB_INPUT_DELAY cover,
+// then a lagging peer that gets sent masks past what rollback_remote takes
+bool rollback_selftest(void) {
+    static const uint8_t latencies[] = {0, 1, RB_INPUT_DELAY, 5, RB_WINDOW, 3 * RB_WINDOW};
+    bool ok = true;
+    for (uint8_t i = 0; i < sizeof(latencies); i++) {
+        ok &= rb_selftest_run(latencies[i], 0);
+    }
+    ok &= rb_selftest_run(1, RB_WINDOW);
+    ok &= rb_selftest_run(5, 2 * RB_WINDOW);
+    return ok;
+}
+#endif
+
+// -------------------------------------------
+// Move generator
+// Every distinct place the current piece can lock, found by a breadth-first
+// search from the spawn over (x, y, rot) using the same moves a player has:
+// shift, one-row soft drop and turns with wall kicks. Works on a plain
+// copy of the rows (logical order, 0 = top) so it can run on boards that
+// only exist in a search. Paths assume inputs come faster than gravity.
+// Only built with MOVEGEN; the bot shares rows_fit and rows_lock.
+// -------------------------------------------
+#define MG_ROWS (BOARD_HEIGHT + 1)    // box y from -1: some boxes have an empty top row
+#define MG_STATES (4 * MG_ROWS * DROP_COLS)
+#define MG_STATE(rot, col, y) ((((rot) * MG_ROWS) + (y) + 1) * DROP_COLS + (col))
+#define MG_MAX_PLACEMENTS 128
+#define MG_NO_LINK 0xFFFF
+
+// true if the piece box fits with its top row at y and its left column at
+// col (box x + ROW_WALL_BITS); same test as check_collision
+static bool rows_fit(const uint16_t rows[BOARD_HEIGHT], uint16_t mask, int col, int y) {
+    if (col < 0 || col >= DROP_COLS) return false;
+    for (int j = 0; j < 4; j++) {
+        uint8_t row = piece_row(mask, j);
+        if (row == 0) continue;
+        if (y + j < 0 || y + j >= BOARD_HEIGHT) return false;
+        if (((uint16_t)row << col) & rows[y + j]) return false;
+    }
+    return true;
+}
+
+// writes the piece into rows at (col, y) and clears what it fills, the
+// stack above falling into place; returns the lines cleared
+static int rows_lock(uint16_t rows[BOARD_HEIGHT], uint16_t mask, int col, int y) {
+    for (int j = 0; j < 4; j++) {
+        if (y + j >= 0 && y + j < BOARD_HEIGHT) rows[y + j] |= (uint16_t)piece_row(mask, j) << col;
+    }
+
+    int lines = 0;
+    int dst = BOARD_HEIGHT - 1;
+    for (int src = BOARD_HEIGHT - 1; src >= 0; src--) {
+        if (rows[src] == ROW_FULL) {
+            lines++;
+        } else {
+            rows[dst--] = rows[src];
         }
+    }
+    while (dst >= 0) rows[dst--] = ROW_EMPTY;
+    return lines;
+}
 
+#ifdef MOVEGEN
+typedef struct {
+    uint8_t count;
+    bool truncated;                        // more than MG_MAX_PLACEMENTS
+    uint16_t state[MG_MAX_PLACEMENTS];     // MG_STATE of each, unpack with mg_unpack
+} Placements;
 
-        p->y--;
+typedef struct {
+    uint8_t piece;
+    uint16_t link[MG_STATES];     // state it was reached from << 3 | ACTION_*
+    uint16_t queue[MG_STATES];
+    uint16_t seen[4][MG_ROWS];    // bit per col
+    uint32_t cells[MG_MAX_PLACEMENTS];  // what each placement covers, see mg_cells
+} MoveGen;
+
+static inline void mg_unpack(uint16_t state, uint8_t *rot, int *col, int *y) {
+    *col = state % DROP_COLS;
+    state /= DROP_COLS;
+    *y = (int)(state % MG_ROWS) - 1;
+    *rot = state / MG_ROWS;
+}
 
-        if (p->y < 0) {
-            p->y = 0;  // clamp to top
+// The cells a piece covers, as one number: the mask slid into the corner
+// of its box plus where that corner is. I, S and Z have turns that cover
+// the same cells from another box position; this tells them apart.
+static uint32_t mg_cells(uint16_t mask, int col, int y) {
+    while (!(mask & 0x1111)) {
+        mask >>= 1;
+        col++;
+    }
+    while (!(mask & 0x000F)) {
+        mask >>= 4;
+        y++;
+    }
+    return mask | ((uint32_t)col << 16) | ((uint32_t)(y + 1) << 24);
+}
+
+// queues a state if it is new and the piece fits there
+static void mg_visit(MoveGen *mg, const uint16_t rows[BOARD_HEIGHT], uint16_t *tail,
+        uint16_t from, uint8_t action, uint8_t rot, int col, int y) {
+    if (y < -1 || y >= BOARD_HEIGHT || col < 0 || col >= DROP_COLS) return;
+    if (mg->seen[rot][y + 1] & (1u << col)) return;
+    if (!rows_fit(rows, PIECE_MASK[mg->piece][rot], col, y)) return;
+
+    uint16_t s = MG_STATE(rot, col, y);
+    mg->seen[rot][y + 1] |= 1u << col;
+    mg->link[s] = (from << 3) | action;
+    mg->queue[(*tail)++] = s;
+}
+
+// Finds every distinct placement of piece spawned on rows into out, each
+// by its shortest input path (see movegen_path). None if the spawn is
+// blocked.
+void movegen(MoveGen *mg, const uint16_t rows[BOARD_HEIGHT], uint8_t piece, Placements *out) {
+    uint16_t head = 0, tail = 0;
+
+    mg->piece = piece;
+    memset(mg->seen, 0, sizeof(mg->seen));
+    out->count = 0;
+    out->truncated = false;
+
+    mg_visit(mg, rows, &tail, 0, ACTION_NONE, 0, (BOARD_WIDTH / 2) - 2 + ROW_WALL_BITS, 0);
+    if (tail == 0) return;
+    mg->link[mg->queue[0]] = MG_NO_LINK;
+
+    int tests = (piece == PIECE_O) ? 1 : KICK_TESTS;
+    while (head < tail) {
+        uint16_t s = mg->queue[head++];
+        uint8_t rot;
+        int col, y;
+        mg_unpack(s, &rot, &col, &y);
+        uint16_t mask = PIECE_MASK[piece][rot];
+
+        // resting here: a placement, unless another box position already
+        // covered the same cells
+        if (!rows_fit(rows, mask, col, y + 1)) {
+            uint32_t cells = mg_cells(mask, col, y);
+            uint8_t i = 0;
+            while (i < out->count && mg->cells[i] != cells) i++;
+            if (i == out->count) {
+                if (out->count < MG_MAX_PLACEMENTS) {
+                    mg->cells[out->count] = cells;
+                    out->state[out->count++] = s;
+                } else {
+                    out->truncated = true;
+                }
+            }
+        }
 
+        mg_visit(mg, rows, &tail, s, ACTION_LEFT, rot, col - 1, y);
+        mg_visit(mg, rows, &tail, s, ACTION_RIGHT, rot, col + 1, y);
+        mg_visit(mg, rows, &tail, s, ACTION_SOFTDROP, rot, col, y + 1);
+
+        // a turn goes to the first kick that fits, like rotate_piece
+        for (uint8_t dir = 1; dir <= 3; dir += 2) {
+            Kick kick[KICK_TESTS];
+            piece_kicks(piece, rot, dir, kick);
+            uint8_t to = (rot + dir) & 3;
+            for (int i = 0; i < tests; i++) {
+                if (!rows_fit(rows, PIECE_MASK[piece][to], col + kick[i].x, y + kick[i].y)) continue;
+                mg_visit(mg, rows, &tail, s, (dir == 1) ? ACTION_ROTATE_CW : ACTION_ROTATE_CCW,
+                        to, col + kick[i].x, y + kick[i].y);
+                break;
+            }
         }
     }
 }
 
-void handle_hold(Player* p, u8 key, u8 state, u8 prev_state) {
-    if(mods.no_hold){
-        return;
+// Writes the ACTION_*s that take a new piece from the spawn to placement
+// state of the last movegen, first to last, and returns how many. A hard
+// drop after them locks it. Paths longer than max are cut short.
+uint8_t movegen_path(const MoveGen *mg, uint16_t state, uint8_t *path, uint8_t max) {
+    uint8_t len = 0;
+    for (uint16_t s = state; mg->link[s] != MG_NO_LINK; s = mg->link[s] >> 3) len++;
+
+    uint8_t n = len;
+    for (uint16_t s = state; mg->link[s] != MG_NO_LINK; s = mg->link[s] >> 3) {
+        n--;
+        if (n < max) path[n] = mg->link[s] & 7;
     }
-    if (key != KEY_HOLD) return;
-    if (!(prev_state == 0 && state == 1)) return; // rising edge
-    if (!p->can_hold){ //I want to make this so that the piece gets grayed out when you can no longer use hold
-    	return;                     // only once per piece
+    return (len < max) ? len : max;
+}
+#endif
+
+// -------------------------------------------
+// Perft: the number of placement sequences over the first depth pieces of
+// queue, each piece locked (lines cleared) before the next is generated.
+// Only tracks movegen speed between builds, so it and its 6K of scratch
+// are only built with PERFT_BENCH, which prints a timed count at boot.
+// -------------------------------------------
+#ifdef PERFT_BENCH
+#define PERFT_MAX_DEPTH 6
+
+static MoveGen perft_mg;
+static Placements perft_found[PERFT_MAX_DEPTH];
+
+uint32_t perft(const uint16_t rows[BOARD_HEIGHT], const uint8_t *queue, uint8_t depth) {
+    if (depth == 0) return 1;
+    if (depth > PERFT_MAX_DEPTH) depth = PERFT_MAX_DEPTH;
+
+    Placements *found = &perft_found[depth - 1];
+    movegen(&perft_mg, rows, queue[0], found);
+    if (depth == 1) return found->count;
+
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < found->count; i++) {
+        uint16_t next[BOARD_HEIGHT];
+        uint8_t rot;
+        int col, y;
+        mg_unpack(found->state[i], &rot, &col, &y);
+        memcpy(next, rows, sizeof(next));
+        rows_lock(next, PIECE_MASK[queue[0]][rot], col, y);
+        total += perft(next, queue + 1, depth - 1);
     }
+    return total;
+}
 
-    uint8_t temp = p->piece;
-    if (p->hold_piece == EMPTY_HOLD) {
-        // no held piece yet
-        p->hold_piece = temp;
-        spawn_new_piece(p);
+#ifndef PERFT_DEPTH
+#define PERFT_DEPTH 2
+#endif
+
+// perft from an empty board over a fixed queue, with the ticks it took
+void perft_bench(void) {
+    static const uint8_t queue[PERFT_MAX_DEPTH] = {2, 0, 3, 5, 1, 4}; // T I S J O Z
+    uint16_t rows[BOARD_HEIGHT];
+    for (int y = 0; y < BOARD_HEIGHT; y++) rows[y] = ROW_EMPTY;
+
+    uint32_t t0 = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+    uint32_t nodes = perft(rows, queue, PERFT_DEPTH);
+    uint32_t ticks = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER) - t0;
+    printf("perft %d: %lu placements, %lu ms\r\n", PERFT_DEPTH,
+            (unsigned long)nodes, (unsigned long)(ticks / TICKS_PER_MS));
+}
+#endif
+
+// -------------------------------------------
+// CPU opponent for the single player mod
+// Plays P2 through the same handlers the keyboard drives. For each piece it
+// beam searches placements of the current or hold piece, then the preview
+// pieces in order, scoring boards on height, holes, bumpiness and what they
+// clear and send. Placements are straight drops from the top, and only the
+// first piece considers holding.
+// The search runs at most cfg.slice_ticks a frame so the human's board
+// never waits on it, and the best first move is played cfg.think_ticks
+// after the piece shows up, however deep it got. think_ticks is the
+// difficulty: it sets both how far the bot sees and its pieces per second.
+// Different orders (hold then place, place then hold) can reach the same
+// position, as can two turns of I, S or Z covering the same cells. A small
+// transposition table keyed by Zobrist key keeps only the copy reached with
+// the most lines and attack, and reuses its evaluation.
+// -------------------------------------------
+#define BOT_BEAM 8           // boards kept per search layer
+#define BOT_MAX_DEPTH 6      // current piece + the 5 previews
+#define BOT_TT_SIZE 128      // transposition table entries, power of two
+
+// heuristic weights, per unit of each feature
+#define BOT_W_HEIGHT 510     // summed column heights
+#define BOT_W_HOLES  360     // empty cells with a block somewhere above
+#define BOT_W_BUMP   180     // summed height steps between neighbours
+#define BOT_W_LINES  760     // lines cleared on the way
+#define BOT_W_ATTACK 500     // garbage sent on the way
+
+// a first move: hold or not, rotation, column of the piece box
+#define BOT_MOVE(hold, rot, col) (((hold) << 6) | ((rot) << 4) | (col))
+#define BOT_HOLD(m) (((m) >> 6) & 1)
+#define BOT_ROT(m) (((m) >> 4) & 3)
+#define BOT_X(m) (((m) & 0xF) - ROW_WALL_BITS)
+#define BOT_NO_MOVE 0xFF
+#define BOT_SPAWN_COL ((BOARD_WIDTH / 2) - 2 + ROW_WALL_BITS)
+
+typedef struct {
+    uint32_t think_ticks;    // from a piece appearing to the bot dropping it
+    uint32_t slice_ticks;    // most search time per frame
+} BotConfig;
+
+// copied in by bot_init
+const BotConfig BOT_DEFAULTS = {
+    .think_ticks = 400 * TICKS_PER_MS,  // 2.5 pieces a second
+    .slice_ticks = 2 * TICKS_PER_MS,
+};
+
+typedef struct {
+    uint16_t rows[BOARD_HEIGHT];  // logical order (0 = top), walls as in Player
+    uint64_t hash;                // board_hash of rows
+    int32_t value;
+    uint8_t lines;                // cleared on the way here
+    uint8_t sent;                 // garbage sent on the way here
+    uint8_t move;                 // first placement on the way here
+    uint8_t hold;                 // hold piece here
+    uint8_t used;                 // queue pieces placed or held on the way here
+} BotNode;
+
+// One cached position. Slots are simply overwritten by whatever lands on
+// them last; there is one core, so nothing to lock.
+typedef struct {
+    uint32_t check;               // top half of the Zobrist key
+    int32_t eval;                 // bot_eval of the board
+    uint16_t gen;                 // search that last reached it, 0 = empty
+    uint16_t bonus;               // best lines and attack value gen reached it with
+} BotTTEntry;
+
+typedef struct {
+    Player *p;
+    BotConfig cfg;
+
+    // search for the piece p had when p->pieces was pieces
+    uint32_t pieces;
+    uint32_t drop_at;             // tick the move gets played
+    uint32_t gravity;             // game gravity fall was worked out with
+    uint8_t fall;                 // row gravity has the piece on by drop_at
+    uint8_t fall_rows;            // rows gravity moves a piece in the think time
+    uint32_t next_slice;          // tick the next search slice may start
+    bool searching;
+    uint8_t queue[BOT_MAX_DEPTH]; // current piece, then p's next pieces
+    uint8_t max_depth;
+    uint8_t depth;                // layer being expanded
+    uint8_t parent;               // node of that layer being expanded
+    uint8_t option;               // next placement of parent, BOT_MOVE layout
+    uint8_t layer_len;
+    uint8_t next_len;
+    uint8_t best;                 // first move of the best finished layer
+    uint32_t scored;              // boards scored so far
+    BotNode layer[BOT_BEAM];
+    BotNode next[BOT_BEAM];       // best children so far, best first
+    uint16_t gen;                 // search number, for BotTTEntry.gen
+    BotTTEntry tt[BOT_TT_SIZE];
+
+    // stats, readable from the debugger
+    uint32_t placements;          // boards scored for the last piece
+    uint8_t last_depth;           // layers finished for the last piece
+    uint32_t holds;               // moves played with a hold
+    uint32_t misses;              // moves that did not end where the search put them
+    uint32_t worst_slice_ticks;   // longest slice; should stay near slice_ticks
+    uint32_t tt_probes;
+    uint32_t tt_hits;             // evaluations saved
+    uint32_t tt_pruned;           // hits on a position this search already had as good
+    uint32_t tt_replaced;         // hits that beat the copy this search already had
+    uint32_t tt_collisions;       // probes that evicted a different position
+} Bot;
+
+// Where bot_play's inputs leave piece on rows: spawned, fallen to row y
+// (or as far as it gets), turned to rot at the first kick that fits like
+// rotate_piece, then shifted a column at a time to col (box position +
+// ROW_WALL_BITS). Returns the row it ends on, or -1 if the spawn, a turn
+// or a shift is blocked.
+static int bot_reach(const uint16_t rows[BOARD_HEIGHT], uint8_t piece, uint8_t rot, int col, int y) {
+    int x = BOT_SPAWN_COL, at = 0;
+    uint8_t r = 0;
+    if (!rows_fit(rows, PIECE_MASK[piece][0], x, 0)) return -1;
+    while (at < y && rows_fit(rows, PIECE_MASK[piece][0], x, at + 1)) at++;
+
+    uint8_t dir = (rot == 3) ? 3 : 1;
+    int tests = (piece == PIECE_O) ? 1 : KICK_TESTS;
+    while (r != rot) {
+        Kick kick[KICK_TESTS];
+        piece_kicks(piece, r, dir, kick);
+        uint8_t to = (r + dir) & 3;
+        int i = 0;
+        while (i < tests && !rows_fit(rows, PIECE_MASK[piece][to], x + kick[i].x, at + kick[i].y)) i++;
+        if (i == tests) return -1;
+        x += kick[i].x;
+        at += kick[i].y;
+        r = to;
+    }
+
+    while (x != col) {
+        int dx = (col < x) ? -1 : 1;
+        if (!rows_fit(rows, PIECE_MASK[piece][rot], x + dx, at)) return -1;
+        x += dx;
+    }
+    return at;
+}
+
+// Plays piece to rot and col from row fall (see bot_reach), drops it and
+// clears what it fills, keeping n's hash. Returns the lines cleared, or -1
+// if the inputs are blocked.
+static int bot_drop(BotNode *n, uint8_t piece, uint8_t rot, int col, int fall) {
+    uint16_t mask = PIECE_MASK[piece][rot];
+    int y = bot_reach(n->rows, piece, rot, col, fall);
+    if (y < 0) return -1;
+
+    while (rows_fit(n->rows, mask, col, y + 1)) y++;
+    int lines = rows_lock(n->rows, mask, col, y);
+
+    if (lines == 0) {
+        for (int j = 0; j < 4; j++) {
+            n->hash ^= zobrist_row(y + j, (uint16_t)piece_row(mask, j) << col);
+        }
     } else {
-        // swap current and held piece
-        p->piece = p->hold_piece;
-        p->hold_piece = temp;
-        p->y = 0;
-        p->x = (BOARD_WIDTH / 2) - 2;
-        p->rot = 0;
+        n->hash = 0;
+        for (int j = 0; j < BOARD_HEIGHT; j++) n->hash ^= zobrist_row(j, n->rows[j]);
+    }
+    return lines;
+}
 
+// heuristic value of a board, higher is better
+static int32_t bot_eval(const uint16_t rows[BOARD_HEIGHT]) {
+    uint8_t height[BOARD_WIDTH] = {0};
+    uint16_t above = 0;           // columns with a block in some row above
+    int32_t total = 0, holes = 0, bump = 0;
+
+    for (int y = 0; y < BOARD_HEIGHT; y++) {
+        uint16_t cells = rows[y] & (uint16_t)~ROW_EMPTY;
+        uint16_t tops = cells & ~above;
+        holes += __builtin_popcount(above & ~cells);
+        while (tops) {
+            height[__builtin_ctz(tops) - ROW_WALL_BITS] = BOARD_HEIGHT - y;
+            total += BOARD_HEIGHT - y;
+            tops &= tops - 1;
+        }
+        above |= cells;
     }
-    p->can_hold = false; // cannot hold again until next piece
+    for (int x = 0; x + 1 < BOARD_WIDTH; x++) {
+        int d = height[x] - height[x + 1];
+        bump += (d < 0) ? -d : d;
+    }
+    return -(BOT_W_HEIGHT * total + BOT_W_HOLES * holes + BOT_W_BUMP * bump);
 }
 
-uint32_t line_score(uint8_t lines) {
-    switch(lines) {
-        case 1: return 100;
-        case 2: return 300;
-        case 3: return 500;
-        case 4: return 800;
-        default: return 0;
+// true if rot of piece has the same shape as a lower rotation
+static bool bot_same_rot(uint8_t piece, uint8_t rot) {
+    for (uint8_t r = 0; r < rot; r++) {
+        if (PIECE_MASK[piece][r] == PIECE_MASK[piece][rot]) return true;
     }
+    return false;
 }
 
-uint32_t pack8Nibbles(uint8_t nibbles[8]) {
-    uint32_t result = 0;
-    for (int i = 0; i < 8; i++) {
-        result = (result << 4) | (nibbles[i] & 0xF); // mask to ensure 4 bits
+// adds n to the next layer if it is among the BOT_BEAM best so far. The
+// table misses a position whose entry got overwritten, so a copy reached by
+// another order can still be here; the one worth more stays.
+static void bot_keep(Bot *b, const BotNode *n) {
+    for (int j = 0; j < b->next_len; j++) {
+        if (b->next[j].hash != n->hash || b->next[j].hold != n->hold || b->next[j].used != n->used) continue;
+        if (b->next[j].value >= n->value) return;
+        b->next_len--;
+        memmove(&b->next[j], &b->next[j + 1], (b->next_len - j) * sizeof(BotNode));
+        break;
     }
-    return result;
+
+    int i = b->next_len;
+    if (i == BOT_BEAM) {
+        if (n->value <= b->next[BOT_BEAM - 1].value) return;
+        i--;
+    } else {
+        b->next_len++;
+    }
+    while (i > 0 && b->next[i - 1].value < n->value) {
+        b->next[i] = b->next[i - 1];
+        i--;
+    }
+    b->next[i] = *n;
 }
 
+// Row p's piece is on once gravity has run every deadline before tick t,
+// the same steps as the TIMER_GRAVITY case of game_step with nothing else
+// moving it. *rows gets how far that is with no floor in the way.
+static int bot_fall(Player *p, uint32_t t, uint32_t *rows) {
+    Game *g = p->game;
+    uint8_t id = TIMER_ID(p->index, TIMER_GRAVITY);
+    uint32_t acc = p->gravity_acc, frames = p->gravity_frames, fell = 0;
+
+    *rows = 0;
+    if (!sched_armed(&g->sched, id)) return p->y;
+    for (uint32_t when = g->sched.deadline[id]; (int32_t)(when - t) < 0 && fell < BOARD_HEIGHT;
+            when += frames * FRAME_TICKS) {
+        acc += g->gravity * frames;
+        fell += acc >> G_SHIFT;
+        acc &= G_ONE - 1;
+        frames = (g->gravity >= G_ONE) ? 1 : (G_ONE - acc + g->gravity - 1) / g->gravity;
+    }
+
+    *rows = fell;
+    int land = drop_row(p, p->x, p->y);
+    return (fell > (uint32_t)(land - p->y)) ? land : p->y + (int)fell;
+}
 
+// (Re)starts the search for p's current piece at tick now, from where
+// gravity will have it by drop_at.
+static void bot_search(Bot *b, uint32_t now) {
+    Player *p = b->p;
+
+    uint32_t rows;
+    b->gravity = p->game->gravity;
+    b->fall = bot_fall(p, b->drop_at, &rows);
+    b->fall_rows = (rows > BOARD_HEIGHT) ? BOARD_HEIGHT : rows;
+    b->next_slice = now;
+    b->searching = true;
+
+    b->queue[0] = p->piece;
+    memcpy(&b->queue[1], p->next_pieces, BOT_MAX_DEPTH - 1);
+    // holding into the empty slot takes a piece from the queue
+    b->max_depth = BOT_MAX_DEPTH - (p->hold_piece == EMPTY_HOLD && !p->game->mods.no_hold);
+
+    BotNode *root = &b->layer[0];
+    for (int y = 0; y < BOARD_HEIGHT; y++) root->rows[y] = p->rows[board_row(p, y)];
+    root->hash = p->hash;
+    root->hold = p->hold_piece;
+    root->value = 0;
+    root->lines = 0;
+    root->sent = 0;
+    root->move = BOT_NO_MOVE;
+    root->used = 0;
+    b->layer_len = 1;
+    b->next_len = 0;
+    b->depth = 0;
+    b->parent = 0;
+    b->option = 0;
+    b->best = BOT_NO_MOVE;
+    b->scored = 0;
+    if (++b->gen == 0) b->gen = 1;
+}
 
-uint8_t garbage_from_lines(uint8_t lines) {
-    switch (lines) {
-        case 2: return 1;
-        case 3: return 2;
-        case 4: return 4;
-        default: return 0;
+// Starts on p's current piece at tick now. The move is played after the
+// think time, or a frame before the lock delay could run out if that is
+// sooner.
+static void bot_start(Bot *b, uint32_t now) {
+    Player *p = b->p;
+
+    b->pieces = p->pieces;
+    uint32_t touch = p->lock_delay_active ? p->lock_delay_start : now;
+    uint32_t last = touch + LOCK_DELAY_TICKS - FRAME_TICKS;
+    b->drop_at = now + b->cfg.think_ticks;
+    if ((int32_t)(b->drop_at - last) > 0) b->drop_at = last;
+    bot_search(b, now);
+}
+
+// The evaluation of n, from the table if it has it, reached by this search
+// with bonus (lines and attack on the way, under 2^16). Returns false if
+// this search already reached the same position with at least that bonus,
+// which then needs no second look.
+static bool bot_lookup(Bot *b, const BotNode *n, uint32_t pos, uint16_t bonus, int32_t *eval) {
+    uint64_t key = zobrist_key(n->hash, n->hold, pos);
+    BotTTEntry *e = &b->tt[(uint32_t)key & (BOT_TT_SIZE - 1)];
+    uint32_t check = key >> 32;
+
+    b->tt_probes++;
+    if (e->gen != 0 && e->check == check) {
+        b->tt_hits++;
+        if (e->gen == b->gen) {
+            if (bonus <= e->bonus) {
+                b->tt_pruned++;
+                return false;
+            }
+            b->tt_replaced++;
+        }
+        e->gen = b->gen;
+        e->bonus = bonus;
+        *eval = e->eval;
+        return true;
+    }
+
+    if (e->gen != 0) b->tt_collisions++;
+    *eval = bot_eval(n->rows);
+    e->check = check;
+    e->eval = *eval;
+    e->gen = b->gen;
+    e->bonus = bonus;
+    return true;
+}
+
+// true if the piece up next at n may be swapped with its hold piece: p
+// still may for the current one, and every later one brings a fresh hold
+static bool bot_can_hold(const Bot *b, const BotNode *n) {
+    if (b->p->game->mods.no_hold || (n->used == 0 && !b->p->can_hold)) return false;
+    return n->hold != b->queue[n->used];
+}
+
+// Scores one placement and moves the search along. Returns false once
+// there is nothing left to try.
+static bool bot_step(Bot *b) {
+    if (b->depth >= b->max_depth) return false;
+
+    const BotNode *parent = &b->layer[b->parent];
+    uint8_t opt = b->option++;
+    bool hold = BOT_HOLD(opt);
+    uint8_t rot = BOT_ROT(opt);
+    uint8_t col = opt & 0xF;
+
+    // the piece placed: the one up next, or with a hold the held one (the
+    // one after, if the slot is empty) while the one up next goes in hold.
+    // Place then hold and hold then place can so reach the same position,
+    // which the table catches.
+    uint8_t up = b->queue[parent->used];
+    uint8_t used = parent->used + 1;
+    uint8_t piece = up;
+    if (hold) piece = (parent->hold == EMPTY_HOLD) ? b->queue[used++] : parent->hold;
+    // and the row it is played from: a held-in piece goes at once, later
+    // ones get the think time to fall
+    int fall = b->fall_rows;
+    if (b->depth == 0) fall = hold ? 0 : b->fall;
+
+    if (col < DROP_COLS && !bot_same_rot(piece, rot)) {
+        BotNode n;
+        memcpy(n.rows, parent->rows, sizeof(n.rows));
+        n.hash = parent->hash;
+        int lines = bot_drop(&n, piece, rot, col, fall);
+        int32_t eval;
+        b->scored++;
+
+        if (lines >= 0) {
+            n.hold = hold ? up : parent->hold;
+            n.used = used;
+            n.lines = parent->lines + lines;
+            n.sent = parent->sent + garbage_from_lines(lines);
+            // at most a tetris a piece: 6 * 4 * (760 + 500), fits
+            uint16_t bonus = BOT_W_LINES * n.lines + BOT_W_ATTACK * n.sent;
+            if (bot_lookup(b, &n, b->pieces + used, bonus, &eval)) {
+                n.move = (b->depth == 0) ? BOT_MOVE(hold, rot, col) : parent->move;
+                n.value = eval + bonus;
+                bot_keep(b, &n);
+            }
+        }
+    }
+
+    // next option, next parent, next layer
+    // every rot and col, then with a hold the same again
+    uint16_t options = BOT_MOVE(1, 0, 0) << bot_can_hold(b, parent);
+    if (b->option < options) return true;
+    b->option = 0;
+    if (++b->parent < b->layer_len) return true;
+
+    if (b->next_len == 0) return false;  // every placement tops out
+    memcpy(b->layer, b->next, b->next_len * sizeof(BotNode));
+    b->layer_len = b->next_len;
+    b->best = b->next[0].move;
+    b->next_len = 0;
+    b->parent = 0;
+    b->depth++;
+    return b->depth < b->max_depth;
+}
+
+// Plays move on p with the normal handlers, then hard drops. A piece
+// gravity has not yet brought down to the row the search played it from
+// (a late wake) is stepped down to it first.
+static void bot_play(Bot *b, uint8_t move) {
+    Player *p = b->p;
+
+    if (move != BOT_NO_MOVE) {
+        int fall = b->fall;
+        if (BOT_HOLD(move)) {
+            handle_hold(p);
+            b->holds++;
+            fall = 0;
+        }
+        while (p->y < fall && soft_step(p)) {}
+
+        uint8_t rot = BOT_ROT(move);
+        int col = BOT_X(move) + ROW_WALL_BITS;
+        uint16_t rows[BOARD_HEIGHT];
+        for (int y = 0; y < BOARD_HEIGHT; y++) rows[y] = p->rows[board_row(p, y)];
+        int y = bot_reach(rows, p->piece, rot, col, fall);
+
+        if (rot == 3) {
+            rotate_piece(p, 3);
+        } else {
+            for (uint8_t i = 0; i < rot; i++) rotate_piece(p, 1);
+        }
+
+        int x = BOT_X(move);
+        while (p->x != x && shift_piece(p, (x < p->x) ? -1 : 1)) {}
+        if (p->rot != rot || p->x != x || p->y != y) b->misses++;
+    }
+    handle_harddrop(p);
+}
+
+// the bot plays p with cfg; call after start_game
+void bot_init(Bot *b, Player *p, const BotConfig *cfg) {
+    memset(b, 0, sizeof(*b));
+    b->p = p;
+    b->cfg = *cfg;
+    b->pieces = p->pieces - 1;  // forces a search on the first bot_think
+}
+
+// Gives the bot its share of this main loop pass at tick now: a new search
+// when its player has a new piece (or the level changed gravity under the
+// old one), at most one search slice per frame, and the move once the
+// piece's think time is up.
+void bot_think(Bot *b, uint32_t now) {
+    Player *p = b->p;
+    if (!p->alive) return;
+    if (p->pieces != b->pieces) {
+        bot_start(b, now);
+    } else if (p->game->gravity != b->gravity) {
+        bot_search(b, now);
+    }
+
+    if (b->searching && (int32_t)(now - b->next_slice) >= 0) {
+        uint32_t t0 = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+        uint32_t spent;
+        do {
+            if (!bot_step(b)) {
+                b->searching = false;
+                break;
+            }
+            spent = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER) - t0;
+        } while (spent < b->cfg.slice_ticks);
+
+        spent = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER) - t0;
+        if (spent > b->worst_slice_ticks) b->worst_slice_ticks = spent;
+        b->next_slice = now + FRAME_TICKS;
+    }
+
+    if ((int32_t)(now - b->drop_at) >= 0) {
+        // an unfinished first layer still has its best placement so far
+        uint8_t move = b->best;
+        if (move == BOT_NO_MOVE && b->next_len > 0) move = b->next[0].move;
+        b->placements = b->scored;
+        b->last_depth = b->depth;
+
+        bot_play(b, move);
+        bot_start(b, now);
+    }
+}
+
+// when bot_think next has something to do, for the idle loop
+bool bot_wake(const Bot *b, uint32_t *deadline) {
+    if (!b->p->alive) return false;
+    *deadline = b->drop_at;
+    if (b->searching && (int32_t)(b->next_slice - b->drop_at) < 0) *deadline = b->next_slice;
+    return true;
+}
+
+// Packs every player's hold and next pieces for the HOLDNEXT window: six
+// nibbles per player, back to back from the top nibble of word 0. Players
+// not in the match (boards past the bot in single player) read as 0.
+void pack_holdnext(const Game *g, uint32_t out[HOLDNEXT_WORDS]) {
+    memset(out, 0, HOLDNEXT_WORDS * sizeof(uint32_t));
+    for (uint8_t i = 0; i < g->num_players; i++) {
+        const Player *p = &g->players[i];
+        uint8_t nib[HOLDNEXT_NIBBLES] = {
+            p->hold_piece, p->next_pieces[0], p->next_pieces[1],
+            p->next_pieces[2], p->next_pieces[3], p->next_pieces[4],
+        };
+        for (uint8_t j = 0; j < HOLDNEXT_NIBBLES; j++) {
+            uint32_t n = i * HOLDNEXT_NIBBLES + j;
+            out[n >> 3] |= (uint32_t)(nib[j] & 0xF) << (28 - 4 * (n & 7)); // mask to ensure 4 bits
+        }
     }
 }
 
-#define HOLDNEXT ((volatile uint32_t*) 0x44A00000)
 
 int main() {
     init_platform();
 
 	XTmrCtr_Initialize(&Usb_timer, XPAR_TIMER_USB_AXI_DEVICE_ID);
-	XTmrCtr_SetOptions(&Usb_timer, 0, 0x00000004UL);
-	XTmrCtr_Start(&Usb_timer, 0);
+	XTmrCtr_SetOptions(&Usb_timer, CLOCK_COUNTER, XTC_AUTO_RELOAD_OPTION);
+	XTmrCtr_Start(&Usb_timer, CLOCK_COUNTER);
 
+#ifdef PERFT_BENCH
+    perft_bench();
+#endif
 
     XUartLite_Initialize(&Uart, UART_DEVICE_ID);
+    init_interrupts();
 
     XGpio_Initialize(&P1KeycodeGpio, PLAYER_1_CODE_GPIO_ID);
     XGpio_SetDataDirection(&P1KeycodeGpio, 1, 0);
@@ -947,315 +3203,171 @@ int main() {
     XGpio_Initialize(&P2KeycodeGpio, PLAYER_2_CODE_GPIO_ID);
     XGpio_SetDataDirection(&P2KeycodeGpio, 1, 0);
 
+#ifdef VSYNC_GPIO_ID
+    XGpio_Initialize(&VsyncGpio, VSYNC_GPIO_ID);
+    XGpio_SetDataDirection(&VsyncGpio, 1, 1);
+#ifdef VSYNC_INTR_ID
+    XGpio_InterruptEnable(&VsyncGpio, XGPIO_IR_CH1_MASK);
+    XGpio_InterruptGlobalEnable(&VsyncGpio);
+#endif
+#endif
+
+    // start every register window from a known state matching its shadow
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        mmio_reset(BOARD_ADDR(i), board_shadow[i], BOARD_WORDS);
+    }
+    mmio_reset(HOLDNEXT, holdnext_shadow, HOLDNEXT_WORDS);
 
-    // UART packet assembly state
-    u8 packet[3];
-    int bytes_needed = 3;
-    uint32_t base_gravity_ticks = 50000000;
-    uint32_t gravity_ticks = 50000000;
-    uint32_t lr_ticks = 75000; // 50 ms;
-    uint32_t tick1;
-    uint32_t tick2;
-    uint8_t nib1[8];
-    uint8_t nib2[8];
-    uint32_t b1;
-    uint32_t b2;
-    int p1_ready = 0;
-    int p2_ready = 0;
-
-    //title screen player structs to make drawings
-    Player P1Title = {
-            .addr = BOARD_P1,
-            .piece = 0,
-            .y = 0,
-            .x = 3,
-            .rot = 0,
-            .lines = 0,
-            .next_piece_index = 1,
-    		.hold_piece = EMPTY_HOLD,
-    		.can_hold = true,
-    		.score = 0,
-    		.holdaddr = HOLDNEXT,
-    		.linestot = 0,
-    		.lock_delay_active = false,
-    		.lock_delay_start = 0
-        };
 
-        Player P2Title = {
-            .addr = BOARD_P2,
-            .piece = 0,
+    // UART packet assembly state
+    u8 packet[PACKET_LEN];
+    uint32_t stamp;
+    uint32_t seed = 1;
+    uint8_t ready = 0;      // bit per player that pressed Enter
+    uint32_t holdnext[HOLDNEXT_WORDS];
+
+    // the whole match; static so it is zeroed (no mods) and off the stack
+    static Game game;
+    static Bot bot;         // plays P2 in single player
+    Player *P1 = &game.players[0];
+    Player *P2 = &game.players[1];
+
+    // the game's own players draw the title screen too; clear_board wipes
+    // the menu before play starts, so no separate title-only structs
+    for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+        game.players[i] = (Player){
+            .addr = BOARD_ADDR(i),
+            .shadow = board_shadow[i],
             .y = 0,
             .x = 3,
             .rot = 0,
-            .lines = 0,
-            .next_piece_index = 1,
     		.hold_piece = EMPTY_HOLD,
     		.can_hold = true,
     		.score = 0,
-    		.holdaddr = (HOLDNEXT+6),
     		.linestot = 0,
     		.lock_delay_active = false,
     		.lock_delay_start = 0
         };
+    }
 
-
-
-
+    // title screen: drain every byte the UART has, and only redraw the
+    // mod list when a mod actually changed. Starts once every player has
+    // pressed Enter; when they did seeds the pieces.
+    bool menu_dirty = true;
     while(1) {
-    	u8 b;
-		if (try_recv_byte(&b)) {
-			packet[3 - bytes_needed] = b;
-			bytes_needed--;
-
-			if (bytes_needed == 0) {
-				// full packet received
-				process_input_event(packet[0], packet[1], packet[2]);
-				bytes_needed = 3;
+		while (recv_packet(packet, &stamp)) {
+			process_input_event(packet[0], packet[1]);
+
+			uint8_t bit = 1 << (packet[0] - 1);
+			if (packet[2] == 1 && packet[1] == KEY_ENTER && !(ready & bit)) {
+				ready |= bit;
+				seed += XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
 			}
+			//GAME MODS
+			if (apply_mod_key(&game.mods, packet[1], packet[2])) menu_dirty = true;
 		}
-	 if (packet[2] == 1 && packet[1] == KEY_ENTER) {
-			 if (packet[0] == 1) {
-				 p1_ready = 1;
-				 tick1 = XTmrCtr_GetValue(&Usb_timer, 0);
-			 }
-			 if (packet[0] == 2) {
-				 p2_ready = 1;
-				 tick2 = XTmrCtr_GetValue(&Usb_timer, 0);
-			 }
-		 }
-     //GAME MODS
-    if (packet[2] == 1 && packet[1] == KEY_FAST_GRAV_MOD) (mods.fast_grav = true);
-    if (packet[2] == 1 && packet[1] == KEY_NO_HOLD_MOD) (mods.no_hold = true);
-    if (packet[2] == 1 && packet[1] == KEY_MESSY_GARBAGE_MOD) (mods.messy_garbage = true);
-    if (packet[2] == 1 && packet[1] == KEY_NO_GARBAGE_MOD) (mods.no_garbage = true);
-    if (packet[2] == 1 && packet[1] == KEY_SINGLE_PLAYER_MOD) (mods.single_player = true);
-
-
 
+	 if (ready == (1 << MAX_PLAYERS) - 1) break;
 
-	 if (p1_ready && p2_ready) {
-		 rng_state = tick1 + tick2;
-		 break;
+	 if (menu_dirty) {
+		 draw_mod_list(&game.mods, P1, P2);
+		 for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+			 writeboard_raw(&game.players[i]);
+		 }
+		 menu_dirty = false;
 	 }
 
-	 draw_mod_list(&P1Title, &P2Title);
-	 writeboard_raw(&P1Title);
-	 writeboard_raw(&P2Title);
-    }
-    init_piece_queue();
-
-    Player P1 = {
-        .addr = BOARD_P1,
-        .piece = piece_queue[0],
-        .y = 0,
-        .x = 3,
-        .rot = 0,
-        .lines = 0,
-        .next_piece_index = 1,
-		.hold_piece = EMPTY_HOLD,
-		.can_hold = true,
-		.score = 0,
-		.holdaddr = HOLDNEXT,
-		.linestot = 0,
-		.lock_delay_active = false,
-		.lock_delay_start = 0
-    };
-
-    Player P2 = {
-        .addr = BOARD_P2,
-        .piece = piece_queue[0],
-        .y = 0,
-        .x = 3,
-        .rot = 0,
-        .lines = 0,
-        .next_piece_index = 1,
-		.hold_piece = EMPTY_HOLD,
-		.can_hold = true,
-		.score = 0,
-		.holdaddr = (HOLDNEXT+6),
-		.linestot = 0,
-		.lock_delay_active = false,
-		.lock_delay_start = 0
-    };
-    *(HOLDNEXT) = 0x01234561;
-    *(HOLDNEXT+1) = 0x12340000;
-    for (int i = 0; i < 5; i++) {
-            P1.next_pieces[i] = piece_queue[P1.next_piece_index + i];
-            P2.next_pieces[i] = piece_queue[P2.next_piece_index + i];
-
-        }
-
-   // init boards
-   memset(P1.grid, 0, sizeof(P1.grid));
-   memset(P2.grid, 0, sizeof(P2.grid));
-   writeboard(&P1);
+	 // nothing on a timer in the menu, only keys can change anything
+	 // (idle_until still wakes every IDLE_MAX_TICKS)
+	 idle_until(false, 0);
+    }
+    start_game(&game, seed, XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER));
 
-   if(!mods.single_player){
-	   writeboard(&P2);
-   } else {
-	   draw_ECE385(&P2);
-	   writeboard_raw(&P2);
+   if(game.mods.single_player){
+	   bot_init(&bot, P2, &BOT_DEFAULTS);
    }
 
+   // init boards; any not in the match just show the logo
+   for (uint8_t i = 0; i < MAX_PLAYERS; i++) {
+	   Player *p = &game.players[i];
+	   if (i < game.num_players) {
+		   writeboard(p);
+	   } else {
+		   draw_ECE385(p);
+		   writeboard_raw(p);
+	   }
+   }
+   pack_holdnext(&game, holdnext);
+   mmio_update(HOLDNEXT, holdnext_shadow, holdnext, HOLDNEXT_WORDS);
 
-    uint32_t last_tick1 = XTmrCtr_GetValue(&Usb_timer, 0);
-    uint32_t last_tick2 = XTmrCtr_GetValue(&Usb_timer, 0);
 
-    // Maintain per-player key + state
-    u8 key1 = 0, key2 = 0;
-    u8 p1Down = 0, p2Down = 0;
-    u8 prev_p1Down = 0, prev_p2Down = 0;
+    // keyboards that drive a board; the bot's P2 ignores its keyboard
+    uint8_t humans = game.mods.single_player ? 1 : game.num_players;
 
     while (1) {
 
         //-----------------------------
         // NON-BLOCKING UART INPUT
         //-----------------------------
-        u8 b;
-        if (try_recv_byte(&b)) {
-            packet[3 - bytes_needed] = b;
-            bytes_needed--;
-
-            if (bytes_needed == 0) {
-                // full packet received
-                process_input_event(packet[0], packet[1], packet[2]);
-
-                if (packet[0] == 1) {
-                    key1      = packet[1];
-                    p1Down    = packet[2];
-                }
-                else if (packet[0] == 2) {
-                    key2      = packet[1];
-                    p2Down    = packet[2];
-                }
+        while (recv_packet(packet, &stamp)) {
+            process_input_event(packet[0], packet[1]);
 
-                bytes_needed = 3;
+            if (packet[0] <= humans) {
+                input_push(&game.players[packet[0] - 1].input, packet[1], packet[2], packet[3], stamp);
             }
         }
 
         //-----------------------------
-        // LEFT/RIGHT, ROTATION, DROPS
+        // GAME: input, gravity, lock delay, auto-repeat
         //-----------------------------
-        uint32_t now = XTmrCtr_GetValue(&Usb_timer, 0);
-
-        if ((uint32_t)(now - last_tick1) >= lr_ticks) {
-
-            // movement
-        	handle_left_right(&P1, key1, p1Down, &p1_left_prev, &p1_right_prev);
-            if(!mods.single_player)
-            	handle_left_right(&P2, key2, p2Down, &p2_left_prev, &p2_right_prev);
-
-            // soft drop (held)
-            handle_softdrop(&P1, key1, p1Down, &p1_down_prev);
-            if(!mods.single_player)
-            handle_softdrop(&P2, key2, p2Down, &p2_down_prev);
-
-            // rotate (edge only)
-            handle_rotate_edge(&P1, key1, p1Down, prev_p1Down);
-            if(!mods.single_player)
-            handle_rotate_edge(&P2, key2, p2Down, prev_p2Down);
-
-            // hard drop (edge only)
-            handle_harddrop_edge(&P1, key1, p1Down, prev_p1Down);
-            if(!mods.single_player)
-            handle_harddrop_edge(&P2, key2, p2Down, prev_p2Down);
-
-            handle_hold(&P1, key1, p1Down, prev_p1Down);
-            if(!mods.single_player) handle_hold(&P2, key2, p2Down, prev_p2Down);
-
-            prev_p1Down = p1Down;
-            if(!mods.single_player) prev_p2Down = p2Down;
-
-            last_tick1 += lr_ticks;
-        }
+        uint32_t now = XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER);
+        if (game.mods.single_player) bot_think(&bot, now);
+        if (game_step(&game, now)) break;
 
         //-----------------------------
-        // GRAVITY TICK
+        // RENDER (once per frame, only boards that changed)
         //-----------------------------
-        if ((uint32_t)(now - last_tick2) >= gravity_ticks) {
-        	bool g2 = false;
-            bool g1 = apply_gravity(&P1, P1.x, now);
-            if(!mods.single_player) g2 = apply_gravity(&P2, P2.x, now);
-
-            clear_lines(&P1);
-            clear_lines(&P2);
-
-            uint8_t gsend1 = garbage_from_lines(P1.lines);
-            uint8_t gsend2 = garbage_from_lines(P2.lines);
+        bool dirty = false;
+        for (uint8_t i = 0; i < game.num_players; i++) {
+            dirty |= game.players[i].dirty;
+        }
 
-            if(!mods.no_garbage && !mods.single_player){
-                if (gsend1 > 0) apply_garbage(&P2, gsend1);
-                if (gsend2 > 0) apply_garbage(&P1, gsend2);
+        bool frame = frame_ready(now);
+        if (frame && dirty) {
+            for (uint8_t i = 0; i < game.num_players; i++) {
+                Player *p = &game.players[i];
+                if (!p->dirty) continue;
+                p->dirty = false;
+                writeboard(p);
+                trace_flush(p, XTmrCtr_GetValue(&Usb_timer, CLOCK_COUNTER));
             }
 
-
-            P1.score += line_score(P1.lines);
-            if(!mods.single_player)
-            P2.score += line_score(P2.lines);
-
-            // Update gravity speed based on cumulative lines
-            uint8_t total_lines = P1.linestot + P2.linestot;
-            gravity_ticks = base_gravity_ticks;
-            uint8_t level = total_lines / 10;   // advance every 10 lines
-            if (level > 9) level = 9;
-            gravity_ticks = gravity_table[level];
-
-            if(mods.fast_grav){
-                gravity_ticks = gravity_table[level] - 10000000;
+            pack_holdnext(&game, holdnext);
+            mmio_update(HOLDNEXT, holdnext_shadow, holdnext, HOLDNEXT_WORDS);
+            dirty = false;
+        }
+        if (frame) {
+            // traced keys that changed nothing on screen this frame
+            for (uint8_t i = 0; i < game.num_players; i++) {
+                if (game.players[i].trace_count) trace_flush(&game.players[i], 0);
             }
-
-            P1.lines = 0;
-            P2.lines = 0;
-            last_tick2 += gravity_ticks;
-
-            if (g1 || g2) break; // gameover
         }
+        uart_tx_pump();
 
         //-----------------------------
-        // RENDER
+        // IDLE until the next input, timer or frame that has work
         //-----------------------------
-        writeboard(&P1);
-        if(!mods.single_player)
-            writeboard(&P2);
-
-        if (!mods.single_player) {
-            // multiplayer
-            nib1[0] = P1.hold_piece;
-            nib1[1] = P1.next_pieces[0];
-            nib1[2] = P1.next_pieces[1];
-            nib1[3] = P1.next_pieces[2];
-            nib1[4] = P1.next_pieces[3];
-            nib1[5] = P1.next_pieces[4];
-            nib1[6] = P2.hold_piece;
-            nib1[7] = P2.next_pieces[0];
-
-            nib2[0] = P2.next_pieces[1];
-            nib2[1] = P2.next_pieces[2];
-            nib2[2] = P2.next_pieces[3];
-            nib2[3] = P2.next_pieces[4];
-        } else {
-            // single player
-            nib1[0] = P1.hold_piece;
-            nib1[1] = P1.next_pieces[0];
-            nib1[2] = P1.next_pieces[1];
-            nib1[3] = P1.next_pieces[2];
-            nib1[4] = P1.next_pieces[3];
-            nib1[5] = P1.next_pieces[4];
-            nib1[6] = 0;  // p2Next
-            nib1[7] = 0;
-
-            nib2[0] = 0;
-            nib2[1] = 0;
-            nib2[2] = 0;
-            nib2[3] = 0;
+        uint32_t wake = 0, frame_at;
+        bool has_wake = sched_next(&game.sched, &wake);
+        if (dirty && next_frame(now, &frame_at)) {
+            if (!has_wake || (int32_t)(frame_at - wake) < 0) wake = frame_at;
+            has_wake = true;
         }
-
-
-        b1 = pack8Nibbles(nib1);
-        b2 = pack8Nibbles(nib2);
-        *(HOLDNEXT) = b1;
-        *(HOLDNEXT + 1) = b2;
-
+        if (game.mods.single_player && bot_wake(&bot, &frame_at)) {
+            if (!has_wake || (int32_t)(frame_at - wake) < 0) wake = frame_at;
+            has_wake = true;
+        }
+        idle_until(has_wake, wake);
     }
 
 